@@ -85,6 +85,7 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -105,6 +106,8 @@
 #define ARRAY_SIZE(_A)     (sizeof(_A) / sizeof((_A)[0]))
 #define BCH_ECC_WORDS(_p)  DIV_ROUND_UP(GF_M(_p) * GF_T(_p), 32)
 #define BCH_ECC_BYTES(_p)  DIV_ROUND_UP(GF_M(_p) * GF_T(_p), 8)
+/* number of 256-entry remainder tables, 8 allow processing 64 bits per step */
+#define BCH_MOD8_TABS(_p) ((BCH_ECC_WORDS(_p) > 1) ? 8 : 4)
 
 
 /*
@@ -124,6 +127,21 @@ struct gf_poly_deg1 {
 	unsigned int c[2];
 };
 
+/* encode_bch_ecc() context with preallocated scratch buffers */
+struct bch_ecc_ctx {
+	int gf;
+	int en;
+	struct bch_control *bch;
+	uint8_t *ecc_buf;
+	uint8_t *tmp_buf;
+	struct bch_ecc_ctx *next;
+};
+
+static struct {
+	pthread_mutex_t ecclock;
+	struct bch_ecc_ctx *eccctx;
+} bch_common = { PTHREAD_MUTEX_INITIALIZER, NULL };
+
 /*
  * same as encode_bch(), but process input data one byte at a time
  */
@@ -184,36 +202,54 @@ static void store_ecc8(struct bch_control *bch, uint8_t *dst,
 	memcpy(dst, pad, BCH_ECC_BYTES(bch) - 4 * nwords);
 }
 
+/* bit reversal lookup table */
+static const uint8_t reverse_tab[256] = {
+	0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0, 0x10, 0x90, 0x50, 0xd0, 0x30, 0xb0, 0x70, 0xf0,
+	0x08, 0x88, 0x48, 0xc8, 0x28, 0xa8, 0x68, 0xe8, 0x18, 0x98, 0x58, 0xd8, 0x38, 0xb8, 0x78, 0xf8,
+	0x04, 0x84, 0x44, 0xc4, 0x24, 0xa4, 0x64, 0xe4, 0x14, 0x94, 0x54, 0xd4, 0x34, 0xb4, 0x74, 0xf4,
+	0x0c, 0x8c, 0x4c, 0xcc, 0x2c, 0xac, 0x6c, 0xec, 0x1c, 0x9c, 0x5c, 0xdc, 0x3c, 0xbc, 0x7c, 0xfc,
+	0x02, 0x82, 0x42, 0xc2, 0x22, 0xa2, 0x62, 0xe2, 0x12, 0x92, 0x52, 0xd2, 0x32, 0xb2, 0x72, 0xf2,
+	0x0a, 0x8a, 0x4a, 0xca, 0x2a, 0xaa, 0x6a, 0xea, 0x1a, 0x9a, 0x5a, 0xda, 0x3a, 0xba, 0x7a, 0xfa,
+	0x06, 0x86, 0x46, 0xc6, 0x26, 0xa6, 0x66, 0xe6, 0x16, 0x96, 0x56, 0xd6, 0x36, 0xb6, 0x76, 0xf6,
+	0x0e, 0x8e, 0x4e, 0xce, 0x2e, 0xae, 0x6e, 0xee, 0x1e, 0x9e, 0x5e, 0xde, 0x3e, 0xbe, 0x7e, 0xfe,
+	0x01, 0x81, 0x41, 0xc1, 0x21, 0xa1, 0x61, 0xe1, 0x11, 0x91, 0x51, 0xd1, 0x31, 0xb1, 0x71, 0xf1,
+	0x09, 0x89, 0x49, 0xc9, 0x29, 0xa9, 0x69, 0xe9, 0x19, 0x99, 0x59, 0xd9, 0x39, 0xb9, 0x79, 0xf9,
+	0x05, 0x85, 0x45, 0xc5, 0x25, 0xa5, 0x65, 0xe5, 0x15, 0x95, 0x55, 0xd5, 0x35, 0xb5, 0x75, 0xf5,
+	0x0d, 0x8d, 0x4d, 0xcd, 0x2d, 0xad, 0x6d, 0xed, 0x1d, 0x9d, 0x5d, 0xdd, 0x3d, 0xbd, 0x7d, 0xfd,
+	0x03, 0x83, 0x43, 0xc3, 0x23, 0xa3, 0x63, 0xe3, 0x13, 0x93, 0x53, 0xd3, 0x33, 0xb3, 0x73, 0xf3,
+	0x0b, 0x8b, 0x4b, 0xcb, 0x2b, 0xab, 0x6b, 0xeb, 0x1b, 0x9b, 0x5b, 0xdb, 0x3b, 0xbb, 0x7b, 0xfb,
+	0x07, 0x87, 0x47, 0xc7, 0x27, 0xa7, 0x67, 0xe7, 0x17, 0x97, 0x57, 0xd7, 0x37, 0xb7, 0x77, 0xf7,
+	0x0f, 0x8f, 0x4f, 0xcf, 0x2f, 0xaf, 0x6f, 0xef, 0x1f, 0x9f, 0x5f, 0xdf, 0x3f, 0xbf, 0x7f, 0xff,
+};
+
 /*
- * reverse bit for byte
+ * reverse bit order in each byte of buffer
  */
-static uint8_t reverse_bit(uint8_t in_byte)
+static void reverse_bits(uint8_t *buf, size_t len)
 {
-	int i;
-	uint8_t out_byte = 0;
-
-	for (i = 0; i < 8; i++) {
-		if (in_byte & ((0x80) >> i)) {
-			out_byte |= 1 << i;
-		}
-	}
+	size_t i;
 
-	return out_byte;
+	for (i = 0; i < len; i++)
+		buf[i] = reverse_tab[buf[i]];
 }
 
 /*
  * swap 32-bit data, including bit reverse and swap to big endian
  */
-static uint32_t swap_data(uint32_t data)
+static inline uint32_t swap_data(uint32_t data)
 {
-	uint32_t r = 0;
+#if defined(__arm__) && (__ARM_ARCH >= 7)
+	uint32_t r;
 
-	r = reverse_bit(data & 0xFF) << 24;
-	r |= reverse_bit((data >> 8) & 0xFF) << 16;
-	r |= reverse_bit((data >> 16) & 0xFF) << 8;
-	r |= reverse_bit((data >> 24) & 0xFF);
+	__asm__("rbit %0, %1" : "=r"(r) : "r"(data));
 
 	return r;
+#else
+	return ((uint32_t)reverse_tab[data & 0xff] << 24) |
+			((uint32_t)reverse_tab[(data >> 8) & 0xff] << 16) |
+			((uint32_t)reverse_tab[(data >> 16) & 0xff] << 8) |
+			(uint32_t)reverse_tab[data >> 24];
+#endif
 }
 
 /**
@@ -236,12 +272,16 @@ void encode_bch(struct bch_control *bch, const uint8_t *data,
 	const unsigned int l = BCH_ECC_WORDS(bch) - 1;
 	unsigned int i, mlen;
 	unsigned long m;
-	uint32_t w, r[l + 1];
+	uint32_t w, v, r[l + 1];
 	const uint32_t *const tab0 = bch->mod8_tab;
 	const uint32_t *const tab1 = tab0 + 256 * (l + 1);
 	const uint32_t *const tab2 = tab1 + 256 * (l + 1);
 	const uint32_t *const tab3 = tab2 + 256 * (l + 1);
-	const uint32_t *pdata, *p0, *p1, *p2, *p3;
+	const uint32_t *const tab4 = tab3 + 256 * (l + 1);
+	const uint32_t *const tab5 = tab4 + 256 * (l + 1);
+	const uint32_t *const tab6 = tab5 + 256 * (l + 1);
+	const uint32_t *const tab7 = tab6 + 256 * (l + 1);
+	const uint32_t *pdata, *p0, *p1, *p2, *p3, *p4, *p5, *p6, *p7;
 
 	if (ecc) {
 		/* load ecc parity bytes into internal 32-bit buffer */
@@ -277,12 +317,35 @@ void encode_bch(struct bch_control *bch, const uint8_t *data,
 	 *           yyyyyyyy  00000000  00000000  mod g = r2 (precomputed)
 	 * xxxxxxxx  00000000  00000000  00000000  mod g = r3 (precomputed)
 	 * xxxxxxxx  yyyyyyyy  zzzzzzzz  tttttttt  mod g = r0^r1^r2^r3
+	 *
+	 * when ecc spans more than one word, two data words are processed per
+	 * step, the first one using tables r4-r7 precomputed for weights
+	 * shifted by additional 32 bits
 	 */
+	if (l > 0) {
+		for (; mlen >= 2; mlen -= 2) {
+			w = r[0] ^ swap_data(*pdata++);
+			v = r[1] ^ swap_data(*pdata++);
+			p0 = tab0 + (l + 1) * ((v >> 0) & 0xff);
+			p1 = tab1 + (l + 1) * ((v >> 8) & 0xff);
+			p2 = tab2 + (l + 1) * ((v >> 16) & 0xff);
+			p3 = tab3 + (l + 1) * ((v >> 24) & 0xff);
+			p4 = tab4 + (l + 1) * ((w >> 0) & 0xff);
+			p5 = tab5 + (l + 1) * ((w >> 8) & 0xff);
+			p6 = tab6 + (l + 1) * ((w >> 16) & 0xff);
+			p7 = tab7 + (l + 1) * ((w >> 24) & 0xff);
+
+			for (i = 0; i < l - 1; i++)
+				r[i] = r[i + 2] ^ p0[i] ^ p1[i] ^ p2[i] ^ p3[i] ^ p4[i] ^ p5[i] ^ p6[i] ^ p7[i];
+
+			for (; i <= l; i++)
+				r[i] = p0[i] ^ p1[i] ^ p2[i] ^ p3[i] ^ p4[i] ^ p5[i] ^ p6[i] ^ p7[i];
+		}
+	}
+
 	while (mlen--) {
 		/* input data is read in big-endian format */
 		/*TODO: big little endian*/
-		/*w = r[0]^cpu_to_be32(*pdata++);*/
-		/*w = r[0]^(uint32_t)(*pdata++);*/
 		w = r[0] ^ swap_data(*pdata++);
 		p0 = tab0 + (l + 1) * ((w >> 0) & 0xff);
 		p1 = tab1 + (l + 1) * ((w >> 8) & 0xff);
@@ -1025,6 +1088,37 @@ static int chien_search(struct bch_control *bch, unsigned int len,
 #define find_poly_roots(_p, _k, _elp, _loc) chien_search(_p, len, _elp, _loc)
 #endif /* USE_CHIEN_SEARCH */
 
+/*
+ * find error locations from syndromes, common part of decode_bch() and
+ * decode_bch_batch()
+ */
+static int decode_bch_syn(struct bch_control *bch, unsigned int len,
+		const unsigned int *syn, unsigned int *errloc)
+{
+	unsigned int nbits;
+	int i, err, nroots;
+
+	err = compute_error_locator_polynomial(bch, syn);
+	if (err > 0) {
+		nroots = find_poly_roots(bch, 1, bch->elp, errloc);
+		if (err != nroots)
+			err = -1;
+	}
+	if (err > 0) {
+		/* post-process raw error locations for easier correction */
+		nbits = (len * 8) + bch->ecc_bits;
+		for (i = 0; i < err; i++) {
+			if (errloc[i] >= nbits) {
+				err = -1;
+				break;
+			}
+			errloc[i] = nbits - 1 - errloc[i];
+			errloc[i] = (errloc[i] & ~7) | (7 - (errloc[i] & 7));
+		}
+	}
+	return (err >= 0) ? err : -EBADMSG;
+}
+
 /**
  * decode_bch - decode received codeword and find bit error locations
  * @bch:      BCH control structure
@@ -1072,8 +1166,7 @@ int decode_bch(struct bch_control *bch, const uint8_t *data, unsigned int len,
 		const unsigned int *syn, unsigned int *errloc)
 {
 	const unsigned int ecc_words = BCH_ECC_WORDS(bch);
-	unsigned int nbits;
-	int i, err, nroots;
+	int i;
 	uint32_t sum;
 
 	/* sanity check: make sure data length can be handled */
@@ -1108,25 +1201,63 @@ int decode_bch(struct bch_control *bch, const uint8_t *data, unsigned int len,
 		syn = bch->syn;
 	}
 
-	err = compute_error_locator_polynomial(bch, syn);
-	if (err > 0) {
-		nroots = find_poly_roots(bch, 1, bch->elp, errloc);
-		if (err != nroots)
-			err = -1;
-	}
-	if (err > 0) {
-		/* post-process raw error locations for easier correction */
-		nbits = (len * 8) + bch->ecc_bits;
-		for (i = 0; i < err; i++) {
-			if (errloc[i] >= nbits) {
-				err = -1;
-				break;
-			}
-			errloc[i] = nbits - 1 - errloc[i];
-			errloc[i] = (errloc[i] & ~7) | (7 - (errloc[i] & 7));
+	return decode_bch_syn(bch, len, syn, errloc);
+}
+
+/**
+ * decode_bch_batch - decode multiple codewords, skipping error-free ones
+ * @bch:        BCH control structure
+ * @data:       received data of the first codeword
+ * @len:        data length of each codeword in bytes
+ * @data_step:  distance between consecutive codewords data in bytes
+ * @recv_ecc:   received ecc of the first codeword
+ * @ecc_step:   distance between consecutive codewords ecc in bytes
+ * @count:      number of codewords
+ * @nerr:       output array of @count decoding results, as returned by
+ *              decode_bch() for each codeword
+ * @errloc:     output array of @count * @bch->t error locations, locations
+ *              of i-th codeword start at @errloc[i * @bch->t]
+ *
+ * Returns:
+ *  The number of codewords with errors (corrected or not), or -EINVAL if
+ *  invalid parameters were provided
+ *
+ * Error-free codewords are detected by comparing received and calculated
+ * ecc words, which is equivalent to checking for zero syndromes; only
+ * codewords with errors go through syndrome computation, error locator
+ * polynomial and root search.
+ */
+int decode_bch_batch(struct bch_control *bch, const uint8_t *data, unsigned int len,
+		unsigned int data_step, const uint8_t *recv_ecc, unsigned int ecc_step,
+		unsigned int count, int *nerr, unsigned int *errloc)
+{
+	const unsigned int ecc_words = BCH_ECC_WORDS(bch);
+	unsigned int i, j;
+	int dirty = 0;
+	uint32_t sum;
+
+	if ((8 * len > (bch->n - bch->ecc_bits)) || (data == NULL) || (recv_ecc == NULL))
+		return -EINVAL;
+
+	for (i = 0; i < count; i++, data += data_step, recv_ecc += ecc_step) {
+		encode_bch(bch, data, len, NULL);
+		load_ecc8(bch, bch->ecc_buf2, recv_ecc);
+		for (j = 0, sum = 0; j < ecc_words; j++) {
+			bch->ecc_buf[j] ^= bch->ecc_buf2[j];
+			sum |= bch->ecc_buf[j];
+		}
+
+		if (!sum) {
+			nerr[i] = 0;
+			continue;
 		}
+
+		compute_syndromes(bch, bch->ecc_buf, bch->syn);
+		nerr[i] = decode_bch_syn(bch, len, bch->syn, errloc + i * bch->t);
+		dirty++;
 	}
-	return (err >= 0) ? err : -EBADMSG;
+
+	return dirty;
 }
 
 /*
@@ -1164,11 +1295,12 @@ static void build_mod8_tables(struct bch_control *bch, const uint32_t *g)
 {
 	int i, j, b, d;
 	uint32_t data, hi, lo, *tab;
+	const uint32_t *src, *p;
 	const int l = BCH_ECC_WORDS(bch);
 	const int plen = DIV_ROUND_UP(bch->ecc_bits + 1, 32);
 	const int ecclen = DIV_ROUND_UP(bch->ecc_bits, 32);
 
-	memset(bch->mod8_tab, 0, 4 * 256 * l * sizeof(*bch->mod8_tab));
+	memset(bch->mod8_tab, 0, BCH_MOD8_TABS(bch) * 256 * l * sizeof(*bch->mod8_tab));
 
 	for (i = 0; i < 256; i++) {
 		/* p(X)=i is a small polynomial of weight <= 8 */
@@ -1190,6 +1322,24 @@ static void build_mod8_tables(struct bch_control *bch, const uint32_t *g)
 			}
 		}
 	}
+
+	if (BCH_MOD8_TABS(bch) == 4)
+		return;
+
+	/* (p(X).X^(8*b+32+deg(g))) mod g(X) is one more 32-bit step of above */
+	for (i = 0; i < 4 * 256; i++) {
+		src = bch->mod8_tab + i * l;
+		tab = bch->mod8_tab + (4 * 256 + i) * l;
+		data = src[0];
+		for (j = 0; j < l - 1; j++)
+			tab[j] = src[j + 1];
+
+		for (b = 0; b < 4; b++) {
+			p = bch->mod8_tab + (b * 256 + ((data >> (8 * b)) & 0xff)) * l;
+			for (j = 0; j < l; j++)
+				tab[j] ^= p[j];
+		}
+	}
 }
 
 /*
@@ -1380,7 +1530,7 @@ struct bch_control *init_bch(int m, int t, unsigned int prim_poly)
 	if (prim_poly == 0)
 		prim_poly = prim_poly_tab[m - min_m];
 
-	bch = malloc(sizeof(*bch));
+	bch = calloc(1, sizeof(*bch));
 	if (bch == NULL)
 		goto fail;
 
@@ -1391,7 +1541,7 @@ struct bch_control *init_bch(int m, int t, unsigned int prim_poly)
 	bch->ecc_bytes = DIV_ROUND_UP(m * t, 8);
 	bch->a_pow_tab = bch_alloc((1 + bch->n) * sizeof(*bch->a_pow_tab), &err);
 	bch->a_log_tab = bch_alloc((1 + bch->n) * sizeof(*bch->a_log_tab), &err);
-	bch->mod8_tab = bch_alloc(words * 1024 * sizeof(*bch->mod8_tab), &err);
+	bch->mod8_tab = bch_alloc(BCH_MOD8_TABS(bch) * 256 * words * sizeof(*bch->mod8_tab), &err);
 	bch->ecc_buf = bch_alloc(words * sizeof(*bch->ecc_buf), &err);
 	bch->ecc_buf2 = bch_alloc(words * sizeof(*bch->ecc_buf2), &err);
 	bch->xi_tab = bch_alloc(m * sizeof(*bch->xi_tab), &err);
@@ -1454,18 +1604,57 @@ void free_bch(struct bch_control *bch)
 	}
 }
 
+/*
+ * get encode_bch_ecc() context for given parameters, must be called with
+ * ecclock held; contexts are kept for the process lifetime
+ */
+static struct bch_ecc_ctx *get_ecc_ctx(int gf, int en, int tmp_buf_size)
+{
+	struct bch_ecc_ctx *ctx;
+	int err = 0;
+
+	for (ctx = bch_common.eccctx; ctx != NULL; ctx = ctx->next) {
+		if ((ctx->gf == gf) && (ctx->en == en))
+			return ctx;
+	}
+
+	ctx = bch_alloc(sizeof(*ctx), &err);
+	if (err)
+		return NULL;
+
+	/* init bch, using default polynomial */
+	ctx->bch = init_bch(gf, en, 0);
+	ctx->ecc_buf = bch_alloc((gf * en + 7) / 8, &err);
+	ctx->tmp_buf = bch_alloc(tmp_buf_size, &err);
+	if ((ctx->bch == NULL) || err) {
+		free_bch(ctx->bch);
+		free(ctx->ecc_buf);
+		free(ctx->tmp_buf);
+		free(ctx);
+		return NULL;
+	}
+
+	ctx->gf = gf;
+	ctx->en = en;
+	ctx->next = bch_common.eccctx;
+	bch_common.eccctx = ctx;
+
+	return ctx;
+}
+
 int encode_bch_ecc(void *source_block, size_t source_size,
 		void *target_block, size_t target_size,
 		int version)
 {
 
+	struct bch_ecc_ctx *ctx;
 	struct bch_control *bch;
 	uint8_t *ecc_buf;
 	int ecc_buf_size;
 	uint8_t *tmp_buf;
 	int tmp_buf_size;
 	int real_buf_size;
-	int i, j;
+	int i;
 	int ecc_bit_off;
 	int data_ecc_blk_size;
 	int low_byte_off, low_bit_off;
@@ -1517,24 +1706,21 @@ int encode_bch_ecc(void *source_block, size_t source_size,
 	if (target_size < m + b0 + e0 * gf / 8 + n * bn + n * en * gf / 8)
 		return -EINVAL;
 
-	/* init bch, using default polynomial */
-	bch = init_bch(gf, en, 0);
-	if (!bch)
-		return -EINVAL;
-
 	/* buffer for ecc */
 	ecc_buf_size = (gf * en + 7) / 8;
-	ecc_buf = malloc(ecc_buf_size);
-	if (!ecc_buf)
-		return -EINVAL;
 
 	/* temp buffer to store data and ecc */
 	tmp_buf_size = b0 + (e0 * gf + 7) / 8 + (bn + (en * gf + 7) / 8) * 7;
-	tmp_buf = malloc(tmp_buf_size);
-	if (!tmp_buf) {
-		free(ecc_buf);
+
+	pthread_mutex_lock(&bch_common.ecclock);
+	ctx = get_ecc_ctx(gf, en, tmp_buf_size);
+	if (ctx == NULL) {
+		pthread_mutex_unlock(&bch_common.ecclock);
 		return -EINVAL;
 	}
+	bch = ctx->bch;
+	ecc_buf = ctx->ecc_buf;
+	tmp_buf = ctx->tmp_buf;
 	memset(tmp_buf, 0, tmp_buf_size);
 
 	/* generate ecc code for each data block and store in temp buffer */
@@ -1546,9 +1732,7 @@ int encode_bch_ecc(void *source_block, size_t source_size,
 		memcpy(tmp_buf + i * (bn + ecc_buf_size), source_block + i * bn, bn);
 
 		/* reverse ecc bit */
-		for (j = 0; j < ecc_buf_size; j++) {
-			ecc_buf[j] = reverse_bit(ecc_buf[j]);
-		}
+		reverse_bits(ecc_buf, ecc_buf_size);
 
 		memcpy(tmp_buf + (i + 1) * bn + i * ecc_buf_size, ecc_buf, ecc_buf_size);
 	}
@@ -1583,7 +1767,6 @@ int encode_bch_ecc(void *source_block, size_t source_size,
 		}
 	}
 
-	free(ecc_buf);
-	free(tmp_buf);
+	pthread_mutex_unlock(&bch_common.ecclock);
 	return 0;
 }
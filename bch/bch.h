@@ -45,7 +45,8 @@
 #ifndef _BCH_H
 #define _BCH_H
 
-// #include <types.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /**
  * struct bch_control - BCH control structure
@@ -95,6 +96,10 @@ int decode_bch(struct bch_control *bch, const uint8_t *data, unsigned int len,
 		const uint8_t *recv_ecc, const uint8_t *calc_ecc,
 		const unsigned int *syn, unsigned int *errloc);
 
+int decode_bch_batch(struct bch_control *bch, const uint8_t *data, unsigned int len,
+		unsigned int data_step, const uint8_t *recv_ecc, unsigned int ecc_step,
+		unsigned int count, int *nerr, unsigned int *errloc);
+
 int encode_bch_ecc(void *source_block, size_t source_size,
 		void *target_block, size_t target_size, int version);
 #endif /* _BCH_H */
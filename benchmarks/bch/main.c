@@ -0,0 +1,189 @@
+/*
+ * Phoenix-RTOS
+ *
+ * BCH encoder benchmark
+ *
+ * Measures throughput of encode_bch() from the bch library and checks the
+ * produced ecc with decode_bch(). Also checks that decode_bch_batch() gives
+ * the same results as decode_bch() on corrupted codewords and compares
+ * their decoding time. To compare encoder versions, build it
+ * against the library of each revision. Does not depend on Phoenix-RTOS
+ * APIs, so it can be also built and run on host:
+ * cc -O2 -c -Ibch bch/bch.c && ar rcs libbch.a bch.o
+ * cc -O2 -Ibch benchmarks/bch/main.c -L. -lbch -lpthread
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bch.h"
+
+
+#define BENCH_M      13
+#define BENCH_BLKSZ  512
+#define BENCH_BLOCKS 64
+#define BENCH_LOOPS  20
+#define BENCH_ECCSZ  128
+#define BENCH_MAXT   64
+
+
+static struct {
+	uint8_t data[BENCH_BLOCKS * BENCH_BLKSZ] __attribute__((aligned(8)));
+	uint8_t rx[BENCH_BLOCKS * BENCH_BLKSZ] __attribute__((aligned(8)));
+	uint8_t ecc[BENCH_BLOCKS][BENCH_ECCSZ];
+	int nerr[BENCH_BLOCKS];
+	unsigned int errloc[BENCH_BLOCKS * BENCH_MAXT];
+} common;
+
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static int bench_decode(struct bch_control *bch, int t)
+{
+	uint64_t start, single, batch;
+	unsigned int blk, i, bit, errloc[BENCH_MAXT];
+	int ret = 0, nerr, dirty = 0;
+
+	/* Block blk gets blk % (t + 3) bit flips, so some blocks are clean and some uncorrectable */
+	memcpy(common.rx, common.data, sizeof(common.rx));
+	for (blk = 0; blk < BENCH_BLOCKS; blk++) {
+		memset(common.ecc[blk], 0, bch->ecc_bytes);
+		encode_bch(bch, common.data + blk * BENCH_BLKSZ, BENCH_BLKSZ, common.ecc[blk]);
+
+		for (i = 0; i < blk % (t + 3); i++) {
+			bit = (blk * 7 + i * 97) % (BENCH_BLKSZ * 8);
+			common.rx[blk * BENCH_BLKSZ + bit / 8] ^= 1 << (bit % 8);
+		}
+		if (i != 0) {
+			dirty++;
+		}
+	}
+
+	start = bench_now();
+	if (decode_bch_batch(bch, common.rx, BENCH_BLKSZ, BENCH_BLKSZ, common.ecc[0], BENCH_ECCSZ, BENCH_BLOCKS, common.nerr, common.errloc) != dirty) {
+		fprintf(stderr, "bch_bench: t=%d decode_bch_batch invalid number of dirty blocks\n", t);
+		return -1;
+	}
+	batch = bench_now() - start;
+
+	single = 0;
+	for (blk = 0; blk < BENCH_BLOCKS; blk++) {
+		start = bench_now();
+		nerr = decode_bch(bch, common.rx + blk * BENCH_BLKSZ, BENCH_BLKSZ, common.ecc[blk], NULL, NULL, errloc);
+		single += bench_now() - start;
+
+		if (nerr != common.nerr[blk]) {
+			ret = -1;
+		}
+		for (i = 0; (ret == 0) && (nerr > 0) && (i < (unsigned int)nerr); i++) {
+			if (errloc[i] != common.errloc[blk * t + i]) {
+				ret = -1;
+			}
+		}
+
+		if (ret < 0) {
+			fprintf(stderr, "bch_bench: t=%d decode_bch_batch differs from decode_bch in block %u\n", t, blk);
+			return -1;
+		}
+	}
+
+	printf("t=%-3d decode_bch: %6llu us, decode_bch_batch: %6llu us (%d of %d blocks corrupted)\n", t,
+			(unsigned long long)single, (unsigned long long)batch, dirty, BENCH_BLOCKS);
+
+	return 0;
+}
+
+
+static int bench_run(int t)
+{
+	struct bch_control *bch;
+	uint64_t start, lib;
+	unsigned int loop, blk, errloc[BENCH_MAXT];
+	int ret = 0, nerr;
+
+	bch = init_bch(BENCH_M, t, 0);
+	if (bch == NULL) {
+		fprintf(stderr, "bch_bench: init_bch(%d, %d) failed\n", BENCH_M, t);
+		return -1;
+	}
+
+	/* Verify ecc, decoder must find no errors and detect a single bit flip */
+	for (blk = 0; blk < BENCH_BLOCKS; blk++) {
+		memset(common.ecc[blk], 0, bch->ecc_bytes);
+		encode_bch(bch, common.data + blk * BENCH_BLKSZ, BENCH_BLKSZ, common.ecc[blk]);
+
+		nerr = decode_bch(bch, common.data + blk * BENCH_BLKSZ, BENCH_BLKSZ, common.ecc[blk], NULL, NULL, errloc);
+		if (nerr == 0) {
+			common.data[blk * BENCH_BLKSZ + blk] ^= 1;
+			nerr = decode_bch(bch, common.data + blk * BENCH_BLKSZ, BENCH_BLKSZ, common.ecc[blk], NULL, NULL, errloc);
+			common.data[blk * BENCH_BLKSZ + blk] ^= 1;
+			nerr = (nerr == 1) ? 0 : -1;
+		}
+
+		if (nerr != 0) {
+			fprintf(stderr, "bch_bench: t=%d invalid ecc of block %u\n", t, blk);
+			ret = -1;
+			break;
+		}
+	}
+
+	if (ret == 0) {
+		start = bench_now();
+		for (loop = 0; loop < BENCH_LOOPS; loop++) {
+			for (blk = 0; blk < BENCH_BLOCKS; blk++) {
+				memset(common.ecc[blk], 0, bch->ecc_bytes);
+				encode_bch(bch, common.data + blk * BENCH_BLKSZ, BENCH_BLKSZ, common.ecc[blk]);
+			}
+		}
+		lib = bench_now() - start;
+
+		/* bytes per microsecond equals MB/s */
+		printf("t=%-3d encode_bch: %6llu us (%llu MB/s)\n", t,
+				(unsigned long long)lib, (unsigned long long)(sizeof(common.data) * BENCH_LOOPS / (lib + 1)));
+
+		ret = bench_decode(bch, t);
+	}
+
+	free_bch(bch);
+
+	return ret;
+}
+
+
+int main(void)
+{
+	static const int tvals[] = { 4, 16, 40, 62 };
+	unsigned int i;
+	int ret = 0;
+
+	srand(1);
+	for (i = 0; i < sizeof(common.data); i++) {
+		common.data[i] = rand();
+	}
+
+	printf("BCH encoder benchmark, m=%d, %d x %d bytes, %d loops\n", BENCH_M, BENCH_BLOCKS, BENCH_BLKSZ, BENCH_LOOPS);
+	for (i = 0; i < sizeof(tvals) / sizeof(tvals[0]); i++) {
+		if (bench_run(tvals[i]) < 0) {
+			ret = EXIT_FAILURE;
+		}
+	}
+
+	return ret;
+}
@@ -0,0 +1,163 @@
+/*
+ * Phoenix-RTOS
+ *
+ * NAND flash simulator
+ *
+ * Serves imx6ull flash server protocol from a file-backed NAND image, so
+ * flash tools (nandtool, nandpart, metacheck, psd) can be run, profiled and
+ * regression-tested without a NAND chip
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/msg.h>
+#include <posix/utils.h>
+
+#include "nandsim.h"
+#include "simsrv.h"
+
+
+static struct {
+	nandsim_t sim;
+	uint32_t port;
+} flashsim_common;
+
+
+static void flashsim_serve(void)
+{
+	msg_rid_t rid;
+	msg_t msg;
+
+	for (;;) {
+		if (msgRecv(flashsim_common.port, &msg, &rid) < 0) {
+			continue;
+		}
+
+		simsrv_handle(&flashsim_common.sim, &msg);
+		msgRespond(flashsim_common.port, &msg, rid);
+	}
+}
+
+
+static void flashsim_help(const char *prog)
+{
+	printf("Usage: %s [options] <image> <device>\n", prog);
+	printf("\t-w <size>   page data size (default: 4096)\n");
+	printf("\t-m <size>   page metadata area size (default: 224)\n");
+	printf("\t-o <size>   user metadata size (default: 16)\n");
+	printf("\t-p <n>      pages per erase block (default: 64)\n");
+	printf("\t-b <n>      number of erase blocks (default: 4096)\n");
+	printf("\t-x <block>  mark block as bad, can be repeated\n");
+	printf("\t-f <n>      bit flips injected per raw page read (default: 0)\n");
+	printf("\t-h          prints help\n");
+}
+
+
+int main(int argc, char **argv)
+{
+	nandsim_t *sim = &flashsim_common.sim;
+	unsigned int bad[32], nbad = 0, i;
+	oid_t oid;
+	int c, err;
+
+	sim->writesz = 4096;
+	sim->metasz = 224;
+	sim->oobsz = 16;
+	sim->npages = 64;
+	sim->nblocks = 4096;
+	sim->flips = 0;
+	sim->seed = 1;
+
+	while ((c = getopt(argc, argv, "w:m:o:p:b:x:f:h")) != -1) {
+		switch (c) {
+			case 'w':
+				sim->writesz = strtoul(optarg, NULL, 0);
+				break;
+
+			case 'm':
+				sim->metasz = strtoul(optarg, NULL, 0);
+				break;
+
+			case 'o':
+				sim->oobsz = strtoul(optarg, NULL, 0);
+				break;
+
+			case 'p':
+				sim->npages = strtoul(optarg, NULL, 0);
+				break;
+
+			case 'b':
+				sim->nblocks = strtoul(optarg, NULL, 0);
+				break;
+
+			case 'x':
+				if (nbad == sizeof(bad) / sizeof(bad[0])) {
+					fprintf(stderr, "flashsim: too many bad blocks\n");
+					return EXIT_FAILURE;
+				}
+				bad[nbad++] = strtoul(optarg, NULL, 0);
+				break;
+
+			case 'f':
+				sim->flips = strtoul(optarg, NULL, 0);
+				break;
+
+			case 'h':
+			default:
+				flashsim_help(argv[0]);
+				return EXIT_SUCCESS;
+		}
+	}
+
+	if (optind + 2 != argc) {
+		flashsim_help(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	err = nandsim_init(sim, argv[optind]);
+	if (err < 0) {
+		fprintf(stderr, "flashsim: failed to open %s image, err: %s\n", argv[optind], strerror(-err));
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < nbad; i++) {
+		err = nandsim_markBad(sim, bad[i]);
+		if (err < 0) {
+			fprintf(stderr, "flashsim: failed to mark block %u as bad, err: %s\n", bad[i], strerror(-err));
+			nandsim_done(sim);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (portCreate(&flashsim_common.port) < 0) {
+		fprintf(stderr, "flashsim: failed to create port\n");
+		nandsim_done(sim);
+		return EXIT_FAILURE;
+	}
+
+	oid.port = flashsim_common.port;
+	oid.id = 0;
+	if (create_dev(&oid, argv[optind + 1]) < 0) {
+		fprintf(stderr, "flashsim: failed to create %s device\n", argv[optind + 1]);
+		portDestroy(flashsim_common.port);
+		nandsim_done(sim);
+		return EXIT_FAILURE;
+	}
+
+	printf("flashsim: %s on %s, %u blocks x %u pages x (%u + %u) bytes\n", argv[optind], argv[optind + 1],
+		sim->nblocks, sim->npages, sim->writesz, sim->metasz);
+
+	flashsim_serve();
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,46 @@
+/*
+ * Phoenix-RTOS
+ *
+ * NAND flash simulator
+ *
+ * In-process message passing to simulated NAND on host
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+
+#include "hostmsg.h"
+#include "simsrv.h"
+
+/* Port 0 is never used, flash manager treats zero oid as no cached device */
+#define HOSTMSG_PORT 1
+
+
+static struct {
+	nandsim_t *sim;
+} hostmsg_common;
+
+
+void hostmsg_attach(nandsim_t *sim, oid_t *oid)
+{
+	hostmsg_common.sim = sim;
+	oid->port = HOSTMSG_PORT;
+	oid->id = 0;
+}
+
+
+int msgSend(uint32_t port, msg_t *msg)
+{
+	if ((port != HOSTMSG_PORT) || (hostmsg_common.sim == NULL)) {
+		return -EINVAL;
+	}
+
+	simsrv_handle(hostmsg_common.sim, msg);
+
+	return EOK;
+}
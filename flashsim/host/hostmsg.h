@@ -0,0 +1,27 @@
+/*
+ * Phoenix-RTOS
+ *
+ * NAND flash simulator
+ *
+ * In-process message passing to simulated NAND on host
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _HOSTMSG_H_
+#define _HOSTMSG_H_
+
+#include <sys/msg.h>
+
+#include "nandsim.h"
+
+
+/* Routes messages sent to returned oid to the simulator */
+extern void hostmsg_attach(nandsim_t *sim, oid_t *oid);
+
+
+#endif
@@ -0,0 +1,54 @@
+/*
+ * Phoenix-RTOS
+ *
+ * NAND flash simulator
+ *
+ * Host subset of imx6ull flash server devctl interface
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _HOST_IMX6ULL_FLASHSRV_H_
+#define _HOST_IMX6ULL_FLASHSRV_H_
+
+#include <stdint.h>
+
+
+enum { flashsrv_devctl_info = 0, flashsrv_devctl_readraw, flashsrv_devctl_writeraw, flashsrv_devctl_readmeta,
+	flashsrv_devctl_writemeta, flashsrv_devctl_erase, flashsrv_devctl_isbad, flashsrv_devctl_readptable,
+	flashsrv_devctl_writeptable };
+
+
+typedef struct {
+	uint64_t size;
+	uint32_t writesz;
+	uint32_t metasz;
+	uint32_t oobsz;
+	uint32_t erasesz;
+} flashsrv_info_t;
+
+
+typedef struct {
+	int type;
+	union {
+		struct {
+			uint32_t address;
+			uint32_t size;
+		} read, write, erase;
+		struct {
+			uint32_t address;
+		} badblock;
+	};
+} flash_i_devctl_t;
+
+
+typedef struct {
+	flashsrv_info_t info;
+} flash_o_devctl_t;
+
+
+#endif
@@ -0,0 +1,76 @@
+/*
+ * Phoenix-RTOS
+ *
+ * NAND flash simulator
+ *
+ * Host subset of Phoenix-RTOS message passing used by flash manager and
+ * simulator, messages are handled in-process by hostmsg.c
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _HOST_SYS_MSG_H_
+#define _HOST_SYS_MSG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+#ifndef EOK
+#define EOK 0
+#endif
+
+
+enum { mtOpen = 0, mtClose, mtRead, mtWrite, mtGetAttr, mtDevCtl };
+
+
+enum { atSize = 0, atDev };
+
+
+typedef struct {
+	uint32_t port;
+	uint64_t id;
+} oid_t;
+
+
+typedef struct {
+	int type;
+	oid_t oid;
+
+	struct {
+		union {
+			struct {
+				off_t offs;
+			} io;
+			struct {
+				int type;
+			} attr;
+			unsigned char raw[64];
+		};
+		void *data;
+		size_t size;
+	} i;
+
+	struct {
+		union {
+			struct {
+				long long val;
+			} attr;
+			unsigned char raw[64];
+		};
+		int err;
+		void *data;
+		size_t size;
+	} o;
+} msg_t;
+
+
+extern int msgSend(uint32_t port, msg_t *msg);
+
+
+#endif
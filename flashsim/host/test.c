@@ -0,0 +1,281 @@
+/*
+ * Phoenix-RTOS
+ *
+ * NAND flash simulator
+ *
+ * Host smoke test and throughput benchmark of nandtool flash manager
+ * against simulated NAND. Erases the device, checks bad block scan,
+ * raw pages round trip, JFFS2 cleanmarkers and injected bit flips, then
+ * measures raw write and read throughput.
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/msg.h>
+
+#include "flashmng.h"
+#include "hostmsg.h"
+#include "nandsim.h"
+
+
+#define TEST_BADBLOCK 1 /* Bad block injected before the test */
+#define TEST_CMBLOCK  3 /* Block with cleanmarker */
+
+#define TEST_CHECK(cond, ...) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "flashsim-test: FAIL: " __VA_ARGS__); \
+			fputc('\n', stderr); \
+			return -1; \
+		} \
+	} while (0)
+
+
+static struct {
+	nandsim_t sim;
+	oid_t oid;
+	uint8_t *data; /* Raw data of one block */
+	uint8_t *buf;  /* Read buffer of one block */
+} test_common;
+
+
+static uint64_t test_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static int test_writeBlock(unsigned int block, const uint8_t *data)
+{
+	const nandsim_t *sim = &test_common.sim;
+	const uint32_t rawpagesz = nandsim_rawpagesz(sim);
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < sim->npages; i++) {
+		err = flashmng_writeraw(test_common.oid, block * sim->npages + i, data + i * rawpagesz, rawpagesz);
+		if (err < 0) {
+			return err;
+		}
+	}
+
+	return EOK;
+}
+
+
+static int test_readBlock(unsigned int block, uint8_t *data)
+{
+	const nandsim_t *sim = &test_common.sim;
+	const uint32_t rawpagesz = nandsim_rawpagesz(sim);
+
+	return flashmng_readrawpages(test_common.oid, (off_t)block * sim->npages * rawpagesz, data, rawpagesz, sim->npages);
+}
+
+
+static int test_smoke(void)
+{
+	nandsim_t *sim = &test_common.sim;
+	const uint32_t rawpagesz = nandsim_rawpagesz(sim);
+	const size_t blocksz = sim->npages * rawpagesz;
+	const flashsrv_info_t *info;
+	unsigned int block, i, nbad = 0, nbits = 0;
+	int err;
+
+	info = flashmng_info(test_common.oid);
+	TEST_CHECK(info != NULL, "device info");
+	TEST_CHECK((info->size == nandsim_size(sim)) && (info->erasesz == sim->npages * sim->writesz) && (info->writesz == sim->writesz), "device geometry");
+
+	/* Whole device erase skips the bad block */
+	TEST_CHECK(flashmng_erase(test_common.oid, 0, sim->nblocks) == EOK, "erase");
+
+	for (block = 0; block < sim->nblocks; block++) {
+		err = flashmng_isbad(test_common.oid, block);
+		TEST_CHECK(err >= 0, "bad block check of block %u", block);
+		TEST_CHECK((err != 0) == (block == TEST_BADBLOCK), "bad block state of block %u", block);
+		nbad += err;
+	}
+	TEST_CHECK(nbad == 1, "number of bad blocks %u", nbad);
+
+	/* Raw pages round trip, bad block marker bytes are left erased */
+	for (i = 0; i < blocksz; i++) {
+		test_common.data[i] = rand();
+	}
+	for (i = 0; i < sim->npages; i++) {
+		test_common.data[i * rawpagesz] = 0xff;
+		test_common.data[i * rawpagesz + 1] = 0xff;
+	}
+
+	TEST_CHECK(test_writeBlock(0, test_common.data) == EOK, "raw write of block 0");
+	TEST_CHECK(test_readBlock(0, test_common.buf) == sim->npages, "raw read of block 0");
+	TEST_CHECK(memcmp(test_common.buf, test_common.data, blocksz) == 0, "raw data of block 0 differs");
+
+	/* Programming can only clear bits, block has to be erased before rewrite */
+	TEST_CHECK(flashmng_erase(test_common.oid, 0, 1) == EOK, "erase of block 0");
+	TEST_CHECK(test_readBlock(0, test_common.buf) == sim->npages, "raw read of erased block 0");
+	for (i = 0; i < blocksz; i++) {
+		TEST_CHECK(test_common.buf[i] == 0xff, "erased block 0 at byte %u", i);
+	}
+
+	/* Cleanmarker is written only on good blocks */
+	TEST_CHECK(flashmng_cleanMarkers(test_common.oid, TEST_BADBLOCK, TEST_CMBLOCK - TEST_BADBLOCK + 1) >= 0, "cleanmarkers");
+	TEST_CHECK(flashmng_isbad(test_common.oid, TEST_BADBLOCK) == 1, "bad block after cleanmarkers");
+	TEST_CHECK(test_readBlock(TEST_CMBLOCK, test_common.buf) == sim->npages, "raw read of block %u", TEST_CMBLOCK);
+	TEST_CHECK((test_common.buf[0] == 0x85) && (test_common.buf[1] == 0x19), "cleanmarker of block %u", TEST_CMBLOCK);
+
+	/* Each raw read gets injected bit flips */
+	TEST_CHECK(test_writeBlock(0, test_common.data) == EOK, "raw write of block 0");
+	sim->flips = 1;
+	err = test_readBlock(0, test_common.buf);
+	sim->flips = 0;
+	TEST_CHECK(err == sim->npages, "raw read of block 0 with bit flips");
+	for (i = 0; i < blocksz; i++) {
+		nbits += __builtin_popcount(test_common.buf[i] ^ test_common.data[i]);
+	}
+	TEST_CHECK(nbits == sim->npages, "%u bit flips in %u pages", nbits, sim->npages);
+
+	return EOK;
+}
+
+
+static int test_bench(void)
+{
+	const nandsim_t *sim = &test_common.sim;
+	const size_t blocksz = sim->npages * nandsim_rawpagesz(sim);
+	uint64_t start, wr, rd;
+	unsigned int block, n = 0;
+
+	TEST_CHECK(flashmng_erase(test_common.oid, 0, sim->nblocks) == EOK, "erase");
+
+	start = test_now();
+	for (block = 0; block < sim->nblocks; block++) {
+		if (block != TEST_BADBLOCK) {
+			TEST_CHECK(test_writeBlock(block, test_common.data) == EOK, "raw write of block %u", block);
+			n++;
+		}
+	}
+	wr = test_now() - start;
+
+	start = test_now();
+	for (block = 0; block < sim->nblocks; block++) {
+		if (block != TEST_BADBLOCK) {
+			TEST_CHECK(test_readBlock(block, test_common.buf) == sim->npages, "raw read of block %u", block);
+		}
+	}
+	rd = test_now() - start;
+
+	/* bytes per microsecond equals MB/s */
+	printf("flashsim-test: %u blocks, raw write: %llu us (%llu MB/s), raw read: %llu us (%llu MB/s)\n", n,
+		(unsigned long long)wr, (unsigned long long)(n * blocksz / (wr + 1)),
+		(unsigned long long)rd, (unsigned long long)(n * blocksz / (rd + 1)));
+
+	return EOK;
+}
+
+
+static void test_help(const char *prog)
+{
+	printf("Usage: %s [options] [image]\n", prog);
+	printf("\t-b <n>  number of erase blocks (default: 32)\n");
+	printf("\t-p <n>  pages per erase block (default: 16)\n");
+	printf("\t-k      keep image file\n");
+	printf("\t-h      prints help\n");
+}
+
+
+int main(int argc, char **argv)
+{
+	nandsim_t *sim = &test_common.sim;
+	const char *path = "flashsim-test.img";
+	int c, err, keep = 0;
+
+	sim->writesz = 4096;
+	sim->metasz = 224;
+	sim->oobsz = 16;
+	sim->npages = 16;
+	sim->nblocks = 32;
+	sim->flips = 0;
+	sim->seed = 1;
+
+	while ((c = getopt(argc, argv, "b:p:kh")) != -1) {
+		switch (c) {
+			case 'b':
+				sim->nblocks = strtoul(optarg, NULL, 0);
+				break;
+
+			case 'p':
+				sim->npages = strtoul(optarg, NULL, 0);
+				break;
+
+			case 'k':
+				keep = 1;
+				break;
+
+			case 'h':
+			default:
+				test_help(argv[0]);
+				return EXIT_SUCCESS;
+		}
+	}
+
+	if (optind < argc) {
+		path = argv[optind];
+	}
+
+	if (sim->nblocks <= TEST_CMBLOCK) {
+		fprintf(stderr, "flashsim-test: at least %u blocks required\n", TEST_CMBLOCK + 1);
+		return EXIT_FAILURE;
+	}
+
+	/* Start from a fresh image */
+	unlink(path);
+	err = nandsim_init(sim, path);
+	if (err < 0) {
+		fprintf(stderr, "flashsim-test: failed to create %s image, err: %s\n", path, strerror(-err));
+		return EXIT_FAILURE;
+	}
+
+	test_common.data = malloc(sim->npages * nandsim_rawpagesz(sim));
+	test_common.buf = malloc(sim->npages * nandsim_rawpagesz(sim));
+	if ((test_common.data == NULL) || (test_common.buf == NULL)) {
+		fprintf(stderr, "flashsim-test: failed to allocate buffers\n");
+		err = -ENOMEM;
+	}
+	else {
+		srand(1);
+		hostmsg_attach(sim, &test_common.oid);
+
+		err = nandsim_markBad(sim, TEST_BADBLOCK);
+		if (err == EOK) {
+			err = test_smoke();
+		}
+		if (err == EOK) {
+			err = test_bench();
+		}
+	}
+
+	free(test_common.buf);
+	free(test_common.data);
+	nandsim_done(sim);
+	if (keep == 0) {
+		unlink(path);
+	}
+
+	printf("flashsim-test: %s\n", (err == EOK) ? "OK" : "FAIL");
+
+	return (err == EOK) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
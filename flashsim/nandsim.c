@@ -0,0 +1,320 @@
+/*
+ * Phoenix-RTOS
+ *
+ * NAND flash simulator
+ *
+ * File-backed NAND engine
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nandsim.h"
+
+/* Metadata ECC compatible with imx6ull BCH metadata layout */
+#define METAECC_STRENGTH 16
+#define METAECC_GF       13
+
+
+static off_t nandsim_rawoffs(const nandsim_t *sim, unsigned int page)
+{
+	return (off_t)page * nandsim_rawpagesz(sim);
+}
+
+
+static int nandsim_checkPage(const nandsim_t *sim, unsigned int page)
+{
+	return (page < sim->npages * sim->nblocks) ? 0 : -EINVAL;
+}
+
+
+static int nandsim_load(nandsim_t *sim, unsigned int page)
+{
+	if (pread(sim->fd, sim->page, nandsim_rawpagesz(sim), nandsim_rawoffs(sim, page)) != nandsim_rawpagesz(sim)) {
+		return -EIO;
+	}
+
+	return 0;
+}
+
+
+/* Programming can only clear bits, just like on a real NAND */
+static int nandsim_program(nandsim_t *sim, unsigned int page, size_t offs, const uint8_t *data, size_t size)
+{
+	size_t i;
+	int err;
+
+	err = nandsim_load(sim, page);
+	if (err < 0) {
+		return err;
+	}
+
+	for (i = 0; i < size; i++) {
+		sim->page[offs + i] &= data[i];
+	}
+
+	if (pwrite(sim->fd, sim->page, nandsim_rawpagesz(sim), nandsim_rawoffs(sim, page)) != nandsim_rawpagesz(sim)) {
+		return -EIO;
+	}
+
+	return 0;
+}
+
+
+static uint8_t nandsim_reverse(uint8_t b)
+{
+	b = ((b & 0xaa) >> 1) | ((b & 0x55) << 1);
+	b = ((b & 0xcc) >> 2) | ((b & 0x33) << 2);
+
+	return (b >> 4) | (b << 4);
+}
+
+
+int nandsim_isBad(nandsim_t *sim, unsigned int block)
+{
+	int err;
+
+	if (block >= sim->nblocks) {
+		return -EINVAL;
+	}
+
+	err = nandsim_load(sim, block * sim->npages);
+	if (err < 0) {
+		return err;
+	}
+
+	return ((sim->page[0] == 0) && (sim->page[1] == 0)) ? 1 : 0;
+}
+
+
+int nandsim_markBad(nandsim_t *sim, unsigned int block)
+{
+	static const uint8_t marker[2] = { 0, 0 };
+
+	if (block >= sim->nblocks) {
+		return -EINVAL;
+	}
+
+	return nandsim_program(sim, block * sim->npages, 0, marker, sizeof(marker));
+}
+
+
+int nandsim_erase(nandsim_t *sim, unsigned int block)
+{
+	unsigned int page;
+	int err;
+
+	err = nandsim_isBad(sim, block);
+	if (err != 0) {
+		return (err < 0) ? err : -EIO;
+	}
+
+	memset(sim->page, 0xff, nandsim_rawpagesz(sim));
+	for (page = block * sim->npages; page < (block + 1) * sim->npages; page++) {
+		if (pwrite(sim->fd, sim->page, nandsim_rawpagesz(sim), nandsim_rawoffs(sim, page)) != nandsim_rawpagesz(sim)) {
+			return -EIO;
+		}
+	}
+
+	return 0;
+}
+
+
+int nandsim_readRaw(nandsim_t *sim, unsigned int page, void *data)
+{
+	unsigned int i, bit;
+	uint8_t *buf = data;
+
+	if (nandsim_checkPage(sim, page) < 0) {
+		return -EINVAL;
+	}
+
+	if (pread(sim->fd, data, nandsim_rawpagesz(sim), nandsim_rawoffs(sim, page)) != nandsim_rawpagesz(sim)) {
+		return -EIO;
+	}
+
+	/* Injected bit flips are not stored, each read gets different ones */
+	for (i = 0; i < sim->flips; i++) {
+		bit = rand_r(&sim->seed) % (8 * nandsim_rawpagesz(sim));
+		buf[bit / 8] ^= 1 << (bit % 8);
+	}
+
+	return nandsim_rawpagesz(sim);
+}
+
+
+int nandsim_writeRaw(nandsim_t *sim, unsigned int page, const void *data)
+{
+	int err;
+
+	if (nandsim_checkPage(sim, page) < 0) {
+		return -EINVAL;
+	}
+
+	err = nandsim_program(sim, page, 0, data, nandsim_rawpagesz(sim));
+
+	return (err < 0) ? err : nandsim_rawpagesz(sim);
+}
+
+
+int nandsim_readMeta(nandsim_t *sim, unsigned int page, void *data, size_t size)
+{
+	int err;
+
+	if ((nandsim_checkPage(sim, page) < 0) || (size > sim->oobsz)) {
+		return -EINVAL;
+	}
+
+	err = nandsim_load(sim, page);
+	if (err < 0) {
+		return err;
+	}
+	memcpy(data, sim->page, size);
+
+	return (int)size;
+}
+
+
+int nandsim_writeMeta(nandsim_t *sim, unsigned int page, const void *data, size_t size)
+{
+	uint8_t *meta;
+	unsigned int i;
+	int err;
+
+	if ((nandsim_checkPage(sim, page) < 0) || (size > sim->oobsz)) {
+		return -EINVAL;
+	}
+
+	meta = malloc(sim->metasz);
+	if (meta == NULL) {
+		return -ENOMEM;
+	}
+
+	memset(meta, 0xff, sim->metasz);
+	/* Metadata not written by the caller stays erased */
+	memcpy(meta, data, size);
+	if (sim->bch != NULL) {
+		memset(meta + sim->oobsz, 0, sim->bch->ecc_bytes);
+		encode_bch(sim->bch, meta, sim->oobsz, meta + sim->oobsz);
+		for (i = 0; i < sim->bch->ecc_bytes; i++) {
+			meta[sim->oobsz + i] = nandsim_reverse(meta[sim->oobsz + i]);
+		}
+	}
+
+	err = nandsim_program(sim, page, 0, meta, sim->metasz);
+	free(meta);
+
+	return (err < 0) ? err : (int)size;
+}
+
+
+ssize_t nandsim_read(nandsim_t *sim, off_t offs, void *data, size_t size)
+{
+	unsigned int page;
+	size_t len, pos, done = 0;
+
+	if ((offs < 0) || (offs >= nandsim_size(sim))) {
+		return 0;
+	}
+
+	size = (size > nandsim_size(sim) - offs) ? nandsim_size(sim) - offs : size;
+	while (done < size) {
+		page = (offs + done) / sim->writesz;
+		pos = (offs + done) % sim->writesz;
+		len = (size - done > sim->writesz - pos) ? sim->writesz - pos : size - done;
+
+		if (pread(sim->fd, (uint8_t *)data + done, len, nandsim_rawoffs(sim, page) + sim->metasz + pos) != len) {
+			return -EIO;
+		}
+		done += len;
+	}
+
+	return done;
+}
+
+
+ssize_t nandsim_write(nandsim_t *sim, off_t offs, const void *data, size_t size)
+{
+	unsigned int page;
+	size_t len, pos, done = 0;
+	int err;
+
+	if ((offs < 0) || (offs + size > nandsim_size(sim))) {
+		return -EINVAL;
+	}
+
+	while (done < size) {
+		page = (offs + done) / sim->writesz;
+		pos = (offs + done) % sim->writesz;
+		len = (size - done > sim->writesz - pos) ? sim->writesz - pos : size - done;
+
+		err = nandsim_program(sim, page, sim->metasz + pos, (const uint8_t *)data + done, len);
+		if (err < 0) {
+			return err;
+		}
+		done += len;
+	}
+
+	return done;
+}
+
+
+int nandsim_init(nandsim_t *sim, const char *path)
+{
+	unsigned int page, npages = sim->npages * sim->nblocks;
+	off_t size;
+
+	if ((sim->writesz == 0) || (sim->npages == 0) || (sim->nblocks == 0) || (sim->oobsz > sim->metasz) || (sim->metasz < 2)) {
+		return -EINVAL;
+	}
+
+	sim->page = malloc(nandsim_rawpagesz(sim));
+	if (sim->page == NULL) {
+		return -ENOMEM;
+	}
+
+	sim->bch = NULL;
+	sim->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (sim->fd < 0) {
+		free(sim->page);
+		return -errno;
+	}
+
+	/* Extend image with erased pages */
+	size = lseek(sim->fd, 0, SEEK_END);
+	memset(sim->page, 0xff, nandsim_rawpagesz(sim));
+	for (page = (size < 0) ? 0 : size / nandsim_rawpagesz(sim); page < npages; page++) {
+		if (pwrite(sim->fd, sim->page, nandsim_rawpagesz(sim), nandsim_rawoffs(sim, page)) != nandsim_rawpagesz(sim)) {
+			nandsim_done(sim);
+			return -EIO;
+		}
+	}
+
+	/* Metadata ECC is optional, only if it fits in metadata area */
+	sim->bch = init_bch(METAECC_GF, METAECC_STRENGTH, 0);
+	if ((sim->bch != NULL) && (sim->oobsz + sim->bch->ecc_bytes > sim->metasz)) {
+		free_bch(sim->bch);
+		sim->bch = NULL;
+	}
+
+	return 0;
+}
+
+
+void nandsim_done(nandsim_t *sim)
+{
+	close(sim->fd);
+	free_bch(sim->bch);
+	free(sim->page);
+	sim->page = NULL;
+	sim->bch = NULL;
+}
@@ -0,0 +1,93 @@
+/*
+ * Phoenix-RTOS
+ *
+ * NAND flash simulator
+ *
+ * File-backed NAND engine
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _NANDSIM_H_
+#define _NANDSIM_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "bch.h"
+
+
+/*
+ * Image layout: raw pages stored one after another, each raw page is
+ * metadata area (metasz bytes, first oobsz bytes are user metadata followed
+ * by metadata BCH ECC) and page data (writesz bytes).
+ */
+typedef struct {
+	int fd;
+	uint32_t writesz;        /* Page data size */
+	uint32_t metasz;         /* Raw page metadata area size */
+	uint32_t oobsz;          /* User metadata size */
+	uint32_t npages;         /* Pages per erase block */
+	uint32_t nblocks;        /* Number of erase blocks */
+	uint32_t flips;          /* Bit flips injected per raw page read */
+	unsigned int seed;       /* Bit flips PRNG state */
+	uint8_t *page;           /* Raw page buffer */
+	struct bch_control *bch; /* Metadata ECC encoder */
+} nandsim_t;
+
+
+/* Opens (creates erased if needed) image of given geometry */
+extern int nandsim_init(nandsim_t *sim, const char *path);
+
+
+extern void nandsim_done(nandsim_t *sim);
+
+
+static inline uint32_t nandsim_rawpagesz(const nandsim_t *sim)
+{
+	return sim->metasz + sim->writesz;
+}
+
+
+static inline off_t nandsim_size(const nandsim_t *sim)
+{
+	return (off_t)sim->nblocks * sim->npages * sim->writesz;
+}
+
+
+extern int nandsim_isBad(nandsim_t *sim, unsigned int block);
+
+
+/* Marks block bad, bad block markers persist in the image */
+extern int nandsim_markBad(nandsim_t *sim, unsigned int block);
+
+
+extern int nandsim_erase(nandsim_t *sim, unsigned int block);
+
+
+/* Raw page access, returns raw page size or negative error */
+extern int nandsim_readRaw(nandsim_t *sim, unsigned int page, void *data);
+
+
+extern int nandsim_writeRaw(nandsim_t *sim, unsigned int page, const void *data);
+
+
+/* User metadata access up to oobsz bytes, returns size or negative error */
+extern int nandsim_readMeta(nandsim_t *sim, unsigned int page, void *data, size_t size);
+
+
+extern int nandsim_writeMeta(nandsim_t *sim, unsigned int page, const void *data, size_t size);
+
+
+/* Page data access at data space offset, returns number of bytes or negative error */
+extern ssize_t nandsim_read(nandsim_t *sim, off_t offs, void *data, size_t size);
+
+
+extern ssize_t nandsim_write(nandsim_t *sim, off_t offs, const void *data, size_t size);
+
+
+#endif
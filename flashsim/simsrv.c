@@ -0,0 +1,245 @@
+/*
+ * Phoenix-RTOS
+ *
+ * NAND flash simulator
+ *
+ * imx6ull flash server protocol on simulated NAND, shared by flashsim
+ * server and host builds
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/msg.h>
+
+#include <imx6ull-flashsrv.h>
+
+#include "simsrv.h"
+
+
+static int simsrv_readraw(nandsim_t *sim, uint32_t addr, void *data, size_t size)
+{
+	const uint32_t rawpagesz = nandsim_rawpagesz(sim);
+	size_t done;
+	int err;
+
+	if (((addr % rawpagesz) != 0) || ((size % rawpagesz) != 0)) {
+		return -EINVAL;
+	}
+
+	for (done = 0; done < size; done += rawpagesz) {
+		err = nandsim_readRaw(sim, (addr + done) / rawpagesz, (uint8_t *)data + done);
+		if (err < 0) {
+			return err;
+		}
+	}
+
+	return size;
+}
+
+
+static int simsrv_writeraw(nandsim_t *sim, uint32_t addr, const void *data, size_t size)
+{
+	const uint32_t rawpagesz = nandsim_rawpagesz(sim);
+	size_t done;
+	int err;
+
+	if (((addr % rawpagesz) != 0) || ((size % rawpagesz) != 0)) {
+		return -EINVAL;
+	}
+
+	for (done = 0; done < size; done += rawpagesz) {
+		err = nandsim_writeRaw(sim, (addr + done) / rawpagesz, (const uint8_t *)data + done);
+		if (err < 0) {
+			return err;
+		}
+	}
+
+	return size;
+}
+
+
+static int simsrv_erase(nandsim_t *sim, uint32_t addr, uint32_t size)
+{
+	const uint32_t erasesz = sim->npages * sim->writesz;
+	unsigned int block;
+	int err;
+
+	if (((addr % erasesz) != 0) || ((size % erasesz) != 0)) {
+		return -EINVAL;
+	}
+
+	/* Bad blocks in erased range are skipped */
+	for (block = addr / erasesz; block < (addr + size) / erasesz; block++) {
+		err = nandsim_isBad(sim, block);
+		if (err == 0) {
+			err = nandsim_erase(sim, block);
+		}
+
+		if (err < 0) {
+			return err;
+		}
+	}
+
+	return EOK;
+}
+
+
+/* Partition table is kept in the first page of the last block */
+static int simsrv_readptable(nandsim_t *sim, void *data, size_t size)
+{
+	const off_t offs = nandsim_size(sim) - sim->npages * sim->writesz;
+	ssize_t ret;
+
+	if (size > sim->writesz) {
+		return -EINVAL;
+	}
+
+	ret = nandsim_read(sim, offs, data, size);
+	if (ret < 0) {
+		return ret;
+	}
+
+	/* Erased page, no partition table */
+	if ((ret < sizeof(uint32_t)) || (*(uint32_t *)data == 0xffffffff)) {
+		return -ENOENT;
+	}
+
+	return EOK;
+}
+
+
+static int simsrv_writeptable(nandsim_t *sim, const void *data, size_t size)
+{
+	const unsigned int block = sim->nblocks - 1;
+	ssize_t ret;
+	int err;
+
+	if (size > sim->writesz) {
+		return -EINVAL;
+	}
+
+	err = nandsim_erase(sim, block);
+	if (err < 0) {
+		return err;
+	}
+
+	ret = nandsim_write(sim, (off_t)block * sim->npages * sim->writesz, data, size);
+
+	return (ret < 0) ? ret : EOK;
+}
+
+
+static void simsrv_devctl(nandsim_t *sim, msg_t *msg)
+{
+	const flash_i_devctl_t *idevctl = (const flash_i_devctl_t *)msg->i.raw;
+	flash_o_devctl_t *odevctl = (flash_o_devctl_t *)msg->o.raw;
+	unsigned int block;
+
+	switch (idevctl->type) {
+		case flashsrv_devctl_info:
+			memset(&odevctl->info, 0, sizeof(odevctl->info));
+			odevctl->info.size = nandsim_size(sim);
+			odevctl->info.writesz = sim->writesz;
+			odevctl->info.metasz = sim->metasz;
+			odevctl->info.oobsz = sim->oobsz;
+			odevctl->info.erasesz = sim->npages * sim->writesz;
+			msg->o.err = EOK;
+			break;
+
+		case flashsrv_devctl_readraw:
+			msg->o.err = simsrv_readraw(sim, idevctl->read.address, msg->o.data, (msg->o.size < idevctl->read.size) ? msg->o.size : idevctl->read.size);
+			break;
+
+		case flashsrv_devctl_writeraw:
+			msg->o.err = simsrv_writeraw(sim, idevctl->write.address, msg->i.data, msg->i.size);
+			break;
+
+		case flashsrv_devctl_readmeta:
+			if ((msg->o.size > sim->oobsz) || ((idevctl->read.address % sim->writesz) != 0)) {
+				msg->o.err = -EINVAL;
+			}
+			else {
+				msg->o.err = nandsim_readMeta(sim, idevctl->read.address / sim->writesz, msg->o.data, msg->o.size);
+			}
+			break;
+
+		case flashsrv_devctl_writemeta:
+			if ((msg->i.size > sim->oobsz) || ((idevctl->write.address % sim->writesz) != 0)) {
+				msg->o.err = -EINVAL;
+			}
+			else {
+				msg->o.err = nandsim_writeMeta(sim, idevctl->write.address / sim->writesz, msg->i.data, msg->i.size);
+			}
+			break;
+
+		case flashsrv_devctl_erase:
+			msg->o.err = simsrv_erase(sim, idevctl->erase.address, idevctl->erase.size);
+			break;
+
+		case flashsrv_devctl_isbad:
+			block = idevctl->badblock.address / (sim->npages * sim->writesz);
+			msg->o.err = nandsim_isBad(sim, block);
+			break;
+
+		case flashsrv_devctl_readptable:
+			msg->o.err = simsrv_readptable(sim, msg->o.data, msg->o.size);
+			break;
+
+		case flashsrv_devctl_writeptable:
+			msg->o.err = simsrv_writeptable(sim, msg->i.data, msg->i.size);
+			break;
+
+		default:
+			msg->o.err = -ENOSYS;
+			break;
+	}
+}
+
+
+void simsrv_handle(nandsim_t *sim, msg_t *msg)
+{
+	switch (msg->type) {
+		case mtOpen:
+		case mtClose:
+			msg->o.err = EOK;
+			break;
+
+		case mtRead:
+			msg->o.err = nandsim_read(sim, msg->i.io.offs, msg->o.data, msg->o.size);
+			break;
+
+		case mtWrite:
+			msg->o.err = nandsim_write(sim, msg->i.io.offs, msg->i.data, msg->i.size);
+			break;
+
+		case mtGetAttr:
+			if (msg->i.attr.type == atSize) {
+				msg->o.attr.val = nandsim_size(sim);
+				msg->o.err = EOK;
+			}
+			else if (msg->i.attr.type == atDev) {
+				/* Simulated device is a single partition starting at offset 0 */
+				msg->o.attr.val = 0;
+				msg->o.err = EOK;
+			}
+			else {
+				msg->o.err = -EINVAL;
+			}
+			break;
+
+		case mtDevCtl:
+			simsrv_devctl(sim, msg);
+			break;
+
+		default:
+			msg->o.err = -ENOSYS;
+			break;
+	}
+}
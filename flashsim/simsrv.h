@@ -0,0 +1,27 @@
+/*
+ * Phoenix-RTOS
+ *
+ * NAND flash simulator
+ *
+ * imx6ull flash server protocol on simulated NAND
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _SIMSRV_H_
+#define _SIMSRV_H_
+
+#include <sys/msg.h>
+
+#include "nandsim.h"
+
+
+/* Handles flash server request, result is returned in msg->o.err */
+extern void simsrv_handle(nandsim_t *sim, msg_t *msg);
+
+
+#endif
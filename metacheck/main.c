@@ -41,6 +41,7 @@
 #include <sys/types.h>
 #include <sys/msg.h>
 #include <sys/stat.h>
+#include <sys/threads.h>
 
 #include "bch.h"
 
@@ -52,21 +53,64 @@
 #define METAECC_STRENGTH 16
 #define METAECC_GF       13
 
+#define MAX_WORKERS    8
+#define QUEUE_SZ       64
+#define THREAD_STACKSZ 4096
+#define ECC_BATCH      64 /* Pages decoded at once in sequential mode */
+
+
+typedef struct {
+	int totalcnt;
+	int goodcnt;
+	int badecc;
+	int badcnt;
+	int erasedcnt;
+	int weirdcnt;
+} stats_t;
+
 
 typedef struct partition {
 	oid_t oid;
 	uint32_t rawpagesz;
 	uint32_t nblocks;
 	uint32_t rawblocksz;
+	const char *name;
+	stats_t stats;
 } partition_t;
 
 
+/* Page metadata queued by reader threads for ECC workers */
+typedef struct {
+	partition_t *part;
+	size_t offset;
+	uint8_t meta[CLEANMARKER_SZ];
+} qentry_t;
+
+
 static struct {
 	uint8_t buf[PAGE_SZ];
 	partition_t *partitions;
 	int nparts;
 	int pageMode;
 	int verbose;
+	int nworkers;
+	int nobatch;
+
+	/* Worker pool state */
+	handle_t lock;
+	handle_t notEmpty;
+	handle_t notFull;
+	qentry_t queue[QUEUE_SZ];
+	unsigned int head;
+	unsigned int count;
+	int readers;
+
+	/* Sequential mode ECC batch, metadata followed by bit-reversed ECC of non-erased pages */
+	uint8_t cw[ECC_BATCH][CLEANMARKER_SZ];
+	int idx[ECC_BATCH];
+	int nerr[ECC_BATCH];
+	int invalid[ECC_BATCH];
+	unsigned int errloc[ECC_BATCH * METAECC_STRENGTH];
 } common;
 
 
@@ -96,6 +140,32 @@ static int readraw(oid_t oid, uint32_t addr, void *data, int size)
 }
 
 
+/* Reads up to npages consecutive raw pages, returns number of pages read */
+static int readrawPages(partition_t *part, uint32_t addr, uint8_t *data, int npages)
+{
+	int i;
+
+	if ((npages > 1) && (common.nobatch == 0)) {
+		if (readraw(part->oid, addr, data, npages * part->rawpagesz) == 0) {
+			return npages;
+		}
+	}
+
+	/* End of partition or multi-page read not supported, continue page by page */
+	for (i = 0; i < npages; i++) {
+		if (readraw(part->oid, addr + i * part->rawpagesz, data + i * part->rawpagesz, part->rawpagesz) != 0) {
+			break;
+		}
+	}
+
+	if ((i == npages) && (npages > 1)) {
+		common.nobatch = 1;
+	}
+
+	return i;
+}
+
+
 static int containsCleanmarker(const uint8_t *buf)
 {
 	static const uint8_t cleanmarker[] = { 133, 25, 3, 32, 8, 0, 0, 0, 255, 255, 255, 255, 255, 255, 255, 255 };
@@ -163,6 +233,9 @@ static void dumpECC(partition_t *part, const char *type, const uint8_t *inbuf, s
 		return;
 	}
 
+	if (common.nworkers > 0) {
+		printf("%s: ", part->name);
+	}
 	printf("Bad meta ECC (marker: %6s, block: %3u, page: %2u): ", type, block, page);
 	inbuf += META_SZ;
 	for (i = 0; i < METAECC_SZ; i++) {
@@ -178,6 +251,9 @@ static void dumpWeirdMeta(partition_t *part, size_t offset, const uint8_t *inbuf
 	size_t page = (offset % part->rawblocksz) / part->rawpagesz;
 	int i;
 
+	if (common.nworkers > 0) {
+		printf("%s: ", part->name);
+	}
 	printf("Weird metadata (block: %u: page: %u): ", block, page);
 
 	for (i = 0; i < META_SZ; i++) {
@@ -187,62 +263,92 @@ static void dumpWeirdMeta(partition_t *part, size_t offset, const uint8_t *inbuf
 }
 
 
-static int checkPartition(partition_t *part, struct bch_control *bch)
+static int isEccInvalid(struct bch_control *bch, const uint8_t *buf)
 {
 	uint8_t eccbuf[METAECC_SZ];
-	int totalcnt = 0, goodcnt = 0, badecc = 0, badcnt = 0;
-	int erasedcnt = 0, weirdcnt = 0;
-	int ret, eccInvalid;
-	size_t offset = 0;
 
-	ret = readraw(part->oid, 0, common.buf, part->rawpagesz);
-	while (ret == 0) {
-		encodeMeta(bch, common.buf, eccbuf);
-		eccInvalid = memcmp(eccbuf, common.buf + META_SZ, METAECC_SZ);
+	encodeMeta(bch, buf, eccbuf);
 
-		if (containsCleanmarker(common.buf)) {
-			if (eccInvalid) {
-				badecc++;
-				dumpECC(part, "clean", common.buf, offset);
-			}
-			else {
-				goodcnt++;
-			}
-		}
-		else if (isErased(common.buf, META_SZ)) {
-			erasedcnt++;
-			/* If a page is erased we expect ECC bits to be all 0xff too */
-			if (!isErased(common.buf + META_SZ, METAECC_SZ)) {
-				badecc++;
-				dumpECC(part, "erased", common.buf, offset);
-			}
+	return memcmp(eccbuf, buf + META_SZ, METAECC_SZ);
+}
+
+
+/* Checks metadata ECC of n <= ECC_BATCH pages stride bytes apart, only pages with errors are fully decoded */
+static void checkEccBatch(struct bch_control *bch, const uint8_t *buf, size_t stride, int n, int *invalid)
+{
+	int i, j, cnt = 0;
+
+	for (i = 0; i < n; i++, buf += stride) {
+		invalid[i] = 0;
+
+		/* ECC of erased pages is checked by checkPage() */
+		if (isErased(buf, META_SZ)) {
+			continue;
 		}
-		else if (isBadBlock(common.buf)) {
-			badcnt++;
-			if (eccInvalid) {
-				badecc++;
-				dumpECC(part, "bad", common.buf, offset);
-			}
+
+		memcpy(common.cw[cnt], buf, META_SZ);
+		for (j = 0; j < METAECC_SZ; j++) {
+			common.cw[cnt][META_SZ + j] = reverse_bit(buf[META_SZ + j]);
 		}
-		else {
-			/* Weird, unclassified case, always dump metadata */
-			weirdcnt++;
+		common.idx[cnt++] = i;
+	}
 
-			dumpWeirdMeta(part, offset, common.buf);
-			dumpECC(part, "weird", common.buf, offset);
+	if (decode_bch_batch(bch, common.cw[0], META_SZ, CLEANMARKER_SZ, common.cw[0] + META_SZ, CLEANMARKER_SZ, cnt, common.nerr, common.errloc) < 0) {
+		for (i = 0; i < cnt; i++) {
+			common.nerr[i] = -1;
 		}
+	}
+
+	for (i = 0; i < cnt; i++) {
+		invalid[common.idx[i]] = (common.nerr[i] != 0) ? 1 : 0;
+	}
+}
+
 
-		if (common.pageMode) {
-			offset += part->rawpagesz;
+static void checkPage(partition_t *part, const uint8_t *buf, size_t offset, int eccInvalid)
+{
+	stats_t *stats = &part->stats;
+
+	if (containsCleanmarker(buf)) {
+		if (eccInvalid) {
+			stats->badecc++;
+			dumpECC(part, "clean", buf, offset);
 		}
 		else {
-			offset += part->rawblocksz;
+			stats->goodcnt++;
 		}
+	}
+	else if (isErased(buf, META_SZ)) {
+		stats->erasedcnt++;
+		/* If a page is erased we expect ECC bits to be all 0xff too */
+		if (!isErased(buf + META_SZ, METAECC_SZ)) {
+			stats->badecc++;
+			dumpECC(part, "erased", buf, offset);
+		}
+	}
+	else if (isBadBlock(buf)) {
+		stats->badcnt++;
+		if (eccInvalid) {
+			stats->badecc++;
+			dumpECC(part, "bad", buf, offset);
+		}
+	}
+	else {
+		/* Weird, unclassified case, always dump metadata */
+		stats->weirdcnt++;
 
-		totalcnt++;
-		ret = readraw(part->oid, offset, common.buf, part->rawpagesz);
+		dumpWeirdMeta(part, offset, buf);
+		dumpECC(part, "weird", buf, offset);
 	}
 
+	stats->totalcnt++;
+}
+
+
+static int printStats(partition_t *part)
+{
+	stats_t *stats = &part->stats;
+
 	printf("Clean markers valid ECC: %d\n"
 		"Invalid ECC:             %d\n"
 		"Bad block markers:       %d\n"
@@ -250,9 +356,237 @@ static int checkPartition(partition_t *part, struct bch_control *bch)
 		"Weird metadata:          %d\n"
 		"Total:                   %d\n"
 		"==================================\n\n",
-		goodcnt, badecc, badcnt, erasedcnt, weirdcnt, totalcnt);
+		stats->goodcnt, stats->badecc, stats->badcnt, stats->erasedcnt, stats->weirdcnt, stats->totalcnt);
+
+	return (stats->badecc == 0) ? 0 : 1;
+}
+
+
+static size_t nextOffset(partition_t *part, size_t offset)
+{
+	return offset + (common.pageMode ? part->rawpagesz : part->rawblocksz);
+}
+
+
+/* In page mode whole erase blocks are read at once, returns buffer for npages */
+static uint8_t *allocPages(partition_t *part, int *npages)
+{
+	uint8_t *buf = NULL;
+
+	if (common.pageMode) {
+		*npages = part->rawblocksz / part->rawpagesz;
+		buf = malloc(part->rawblocksz);
+	}
+
+	if (buf == NULL) {
+		*npages = 1;
+		buf = malloc(part->rawpagesz);
+	}
+
+	return buf;
+}
+
+
+static int checkPartition(partition_t *part, struct bch_control *bch)
+{
+	size_t offset = 0;
+	int i, j, n, cnt, npages;
+	uint8_t *buf;
+
+	buf = allocPages(part, &npages);
+	if (buf == NULL) {
+		buf = common.buf;
+		npages = 1;
+	}
+
+	do {
+		n = readrawPages(part, offset, buf, npages);
+		for (i = 0; i < n; i += cnt) {
+			cnt = ((n - i) < ECC_BATCH) ? (n - i) : ECC_BATCH;
+			checkEccBatch(bch, buf + i * part->rawpagesz, part->rawpagesz, cnt, common.invalid);
+
+			for (j = 0; j < cnt; j++) {
+				checkPage(part, buf + (i + j) * part->rawpagesz, offset, common.invalid[j]);
+				offset = nextOffset(part, offset);
+			}
+		}
+	} while (n == npages);
+
+	if (buf != common.buf) {
+		free(buf);
+	}
+
+	return printStats(part);
+}
+
+
+static void readerThread(void *arg)
+{
+	partition_t *part = arg;
+	size_t offset = 0;
+	qentry_t *entry;
+	int i, n, npages;
+	uint8_t *buf;
+
+	buf = allocPages(part, &npages);
+	do {
+		n = (buf != NULL) ? readrawPages(part, offset, buf, npages) : 0;
+
+		mutexLock(common.lock);
+		for (i = 0; i < n; i++) {
+			while (common.count == QUEUE_SZ) {
+				condWait(common.notFull, common.lock, 0);
+			}
+			entry = &common.queue[(common.head + common.count) % QUEUE_SZ];
+			entry->part = part;
+			entry->offset = offset;
+			memcpy(entry->meta, buf + i * part->rawpagesz, sizeof(entry->meta));
+			common.count++;
+			condSignal(common.notEmpty);
+
+			offset = nextOffset(part, offset);
+		}
+		mutexUnlock(common.lock);
+	} while (n == npages);
+
+	free(buf);
+
+	mutexLock(common.lock);
+	if (buf == NULL) {
+		printf("%s: Out of memory!\n", part->name);
+		part->stats.badecc++;
+	}
+	common.readers--;
+	condBroadcast(common.notEmpty);
+	mutexUnlock(common.lock);
+
+	endthread();
+}
+
+
+static void workerLoop(struct bch_control *bch)
+{
+	qentry_t entry;
+	int eccInvalid;
+
+	mutexLock(common.lock);
+	for (;;) {
+		while ((common.count == 0) && (common.readers > 0)) {
+			condWait(common.notEmpty, common.lock, 0);
+		}
+
+		if (common.count == 0) {
+			break;
+		}
+
+		entry = common.queue[common.head];
+		common.head = (common.head + 1) % QUEUE_SZ;
+		common.count--;
+		condSignal(common.notFull);
+		mutexUnlock(common.lock);
+
+		eccInvalid = isEccInvalid(bch, entry.meta);
+
+		/* Stats and dumps are shared, classify under lock */
+		mutexLock(common.lock);
+		checkPage(entry.part, entry.meta, entry.offset, eccInvalid);
+	}
+	mutexUnlock(common.lock);
+}
+
+
+static void workerThread(void *arg)
+{
+	workerLoop(arg);
+	endthread();
+}
+
+
+static int checkPartitionsPool(int mask)
+{
+	struct bch_control *bch[MAX_WORKERS] = { NULL };
+	int nthreads = 0, i, ret = 0;
+	handle_t *tids;
+	void *stacks;
+
+	stacks = malloc((common.nworkers + common.nparts) * THREAD_STACKSZ);
+	tids = malloc((common.nworkers + common.nparts) * sizeof(handle_t));
+	if ((stacks == NULL) || (tids == NULL)) {
+		printf("Out of memory!\n");
+		free(stacks);
+		free(tids);
+		return -1;
+	}
+
+	for (i = 0; i < common.nworkers; i++) {
+		bch[i] = init_bch(METAECC_GF, METAECC_STRENGTH, 0);
+		if (bch[i] == NULL) {
+			printf("Fail to initialize BCH encoder\n");
+			ret = -1;
+			break;
+		}
+	}
+
+	if ((ret == 0) && ((mutexCreate(&common.lock) < 0) || (condCreate(&common.notEmpty) < 0) || (condCreate(&common.notFull) < 0))) {
+		printf("Fail to create synchronization primitives\n");
+		ret = -1;
+	}
+
+	if (ret == 0) {
+		/* Readers count has to be set before any worker starts */
+		for (i = 0; i < common.nparts; i++) {
+			if ((mask & (1 << i)) == 0) {
+				common.readers++;
+			}
+		}
+
+		mutexLock(common.lock);
+		for (i = 0; i < common.nparts; i++) {
+			if ((mask & (1 << i)) != 0) {
+				continue;
+			}
+
+			if (beginthreadex(readerThread, priority(-1), (uint8_t *)stacks + nthreads * THREAD_STACKSZ, THREAD_STACKSZ, &common.partitions[i], &tids[nthreads]) < 0) {
+				printf("Fail to start reader for %s\n", common.partitions[i].name);
+				common.partitions[i].stats.badecc++;
+				common.readers--;
+				continue;
+			}
+			nthreads++;
+		}
+
+		for (i = 0; i < common.nworkers; i++) {
+			if (beginthreadex(workerThread, priority(-1), (uint8_t *)stacks + nthreads * THREAD_STACKSZ, THREAD_STACKSZ, bch[i], &tids[nthreads]) < 0) {
+				break;
+			}
+			nthreads++;
+		}
+		mutexUnlock(common.lock);
+
+		/* Readers block on a full queue without workers, run one in place */
+		if (i == 0) {
+			printf("Fail to start ECC workers\n");
+			workerLoop(bch[0]);
+		}
+
+		while (nthreads > 0) {
+			threadJoin(tids[--nthreads], 0);
+		}
+	}
 
-	return (badecc == 0) ? 0 : 1;
+	if (ret == 0) {
+		resourceDestroy(common.notFull);
+		resourceDestroy(common.notEmpty);
+		resourceDestroy(common.lock);
+	}
+
+	for (i = 0; i < common.nworkers; i++) {
+		free_bch(bch[i]);
+	}
+	free(tids);
+	free(stacks);
+
+	return ret;
 }
 
 
@@ -297,8 +631,9 @@ static void printHelp(void)
 		"Returns 0 if all partitions are correct, otherwise the return value is a bitmask,\n"
 		"where i-th bit meaning that the i-th partition can't be accessed or contains bad ECC bits.\n"
 		"  -p:  checks metadata of all pages, by default metacheck checks only the first page\n"
+		"  -j <n>:  scan partitions in parallel using n ECC worker threads (1-%d)\n"
 		"  -v:  verbose, dump bad ECC bytes\n"
-		"  -h:  prints help\n");
+		"  -h:  prints help\n", MAX_WORKERS);
 }
 
 
@@ -307,11 +642,19 @@ int main(int argc, char **argv)
 	int ret = 0, tmpret;
 	int c;
 	int i;
+	char *end;
 	struct bch_control *bch;
 
 	optind = 1;
-	while ((c = getopt(argc, argv, "vph")) != -1) {
+	while ((c = getopt(argc, argv, "vpj:h")) != -1) {
 		switch (c) {
+			case 'j':
+				common.nworkers = strtol(optarg, &end, 10);
+				if ((*end != '\0') || (common.nworkers < 1) || (common.nworkers > MAX_WORKERS)) {
+					printHelp();
+					return 1;
+				}
+				break;
 			case 'v':
 				common.verbose = 1;
 				break;
@@ -346,6 +689,8 @@ int main(int argc, char **argv)
 	}
 
 	for (i = 0; i < common.nparts; i++) {
+		common.partitions[i].name = argv[optind + i];
+		memset(&common.partitions[i].stats, 0, sizeof(stats_t));
 		if (partition_init(&common.partitions[i], argv[optind + i]) != 0) {
 			printf("Fail to open partition: %s\n", argv[optind + i]);
 
@@ -354,6 +699,14 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (common.nworkers > 0) {
+		printf("Scanning %d partitions using %d workers\n", common.nparts, common.nworkers);
+		if (checkPartitionsPool(ret) < 0) {
+			/* Fall back to serial scan */
+			common.nworkers = 0;
+		}
+	}
+
 	for (i = 0; i < common.nparts; i++) {
 		/* Partition not initialized */
 		if (ret & (1 << i)) {
@@ -362,7 +715,12 @@ int main(int argc, char **argv)
 
 		printf("Scanning partition: %s\n", argv[optind + i]);
 		printf("==================================\n");
-		tmpret = checkPartition(&common.partitions[i], bch);
+		if (common.nworkers > 0) {
+			tmpret = printStats(&common.partitions[i]);
+		}
+		else {
+			tmpret = checkPartition(&common.partitions[i], bch);
+		}
 
 		/* Return a bitmask of statuses from all the partitions */
 		ret |= (tmpret << i);
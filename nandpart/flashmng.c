@@ -20,6 +20,11 @@
 #include "flashmng.h"
 
 
+static struct {
+	int nobatch; /* Multi-page metadata reads not supported */
+} flashmng_common;
+
+
 int flashmng_isBad(const oid_t *oid, const flashsrv_info_t *info, unsigned int block)
 {
 	msg_t msg = { 0 };
@@ -84,6 +89,45 @@ int flashmng_readMeta(const oid_t *oid, const flashsrv_info_t *info, void *data,
 }
 
 
+int flashmng_readMetaPages(const oid_t *oid, const flashsrv_info_t *info, void *data, unsigned int page, unsigned int npages)
+{
+	msg_t msg = { 0 };
+	flash_i_devctl_t *idevctl = (flash_i_devctl_t *)msg.i.raw;
+	unsigned int i;
+	int err;
+
+	if ((npages > 1) && (flashmng_common.nobatch == 0)) {
+		msg.type = mtDevCtl;
+		msg.oid = *oid;
+		msg.o.data = data;
+		msg.o.size = npages * info->oobsz;
+		idevctl->type = flashsrv_devctl_readmeta;
+		idevctl->read.address = page * info->writesz;
+		idevctl->read.size = npages * info->oobsz;
+
+		err = msgSend(oid->port, &msg);
+		if (err < 0) {
+			return err;
+		}
+
+		if (msg.o.err == npages * info->oobsz) {
+			return EOK;
+		}
+		flashmng_common.nobatch = 1;
+	}
+
+	/* Multi-page read not supported, continue page by page */
+	for (i = 0; i < npages; i++) {
+		err = flashmng_readMeta(oid, info, (unsigned char *)data + i * info->oobsz, page + i);
+		if (err < 0) {
+			return err;
+		}
+	}
+
+	return EOK;
+}
+
+
 int flashmng_writeMeta(const oid_t *oid, const flashsrv_info_t *info, const void *data, unsigned int page)
 {
 	msg_t msg = { 0 };
@@ -29,6 +29,10 @@ extern int flashmng_erase(const oid_t *oid, const flashsrv_info_t *info, unsigne
 extern int flashmng_readMeta(const oid_t *oid, const flashsrv_info_t *info, void *data, unsigned int page);
 
 
+/* Reads metadata of npages consecutive pages in a single request if possible */
+extern int flashmng_readMetaPages(const oid_t *oid, const flashsrv_info_t *info, void *data, unsigned int page, unsigned int npages);
+
+
 extern int flashmng_writeMeta(const oid_t *oid, const flashsrv_info_t *info, const void *data, unsigned int page);
 
 
@@ -15,6 +15,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -28,6 +29,33 @@
 #include "flashmng.h"
 
 
+#define JOURNAL_MAGIC 0x4c4e524a /* "JRNL" */
+
+
+/* Typical SLC NAND timings used for move time estimation */
+#define EST_PAGE_READ_US   100
+#define EST_PAGE_PROG_US   400
+#define EST_BLOCK_ERASE_US 3000
+
+
+/* Partition move journal states */
+enum { journal_copy = 0, journal_shift, journal_done };
+
+
+/* Partition move journal record, records are written alternately to two slots */
+typedef struct {
+	uint32_t magic;
+	uint32_t seq;       /* Record sequence number, the valid record with the highest one is used */
+	uint32_t state;     /* Move state */
+	ptable_part_t part; /* Partition before move */
+	ptable_part_t mod;  /* Partition after move */
+	uint32_t src;       /* Next source block (copy forward) or end of source blocks left to copy (copy backward) */
+	uint32_t dst;       /* Next destination block (copy forward) or end of destination blocks left to copy (copy backward) */
+	uint32_t end;       /* End of destination area (copy backward) */
+	uint32_t checksum;
+} nandpart_journal_t;
+
+
 typedef struct _nandpart_node_t {
 	ptable_part_t part;
 	struct _nandpart_node_t *prev, *next;
@@ -55,6 +83,13 @@ static struct {
 	nandpart_list_t add; /* Partitions to add */
 	nandpart_list_t mod; /* Partitions to modify */
 	nandpart_list_t rem; /* Partitions to remove */
+
+	/* Partition move journal */
+	int journal;             /* Journal file descriptor, -1 if not used */
+	int jvalid;              /* Journal record is valid */
+	nandpart_journal_t jrec; /* Last journal record */
+
+	int dryrun; /* Validate actions and print estimate only */
 } nandpart_common;
 
 
@@ -66,6 +101,9 @@ static void nandpart_help(const char *prog)
 	printf("\t-o <file>                            - output partition table file\n");
 	printf("\t                                       (if not used write partition table on device)\n");
 	printf("\t-u <file>                            - update partition table to one defined in the file\n");
+	printf("\t-n                                   - dry run, validate actions, print move estimate and resulting table and exit\n");
+	printf("\t-j <file>                            - partition move journal file\n");
+	printf("\t                                       (interrupted move is resumed if the same modification is requested)\n");
 	printf("Partition table operations:\n");
 	printf("\t-a <name:offs:size:type>             - add new partition\n");
 	printf("\t                                       (offs and size are given in eraseblocks)\n");
@@ -187,63 +225,209 @@ static int nandpart_writePtable(FILE *file, ptable_t *ptable)
 }
 
 
-static int nandpart_copyBlock(unsigned int srcBlock, unsigned int dstBlock, unsigned char *buff)
+static uint32_t nandpart_journalChecksum(const nandpart_journal_t *rec)
 {
-	unsigned int i, page, npages;
-	int err;
+	const uint8_t *data = (const uint8_t *)rec;
+	uint32_t checksum = 0;
+	size_t i;
 
-	npages = nandpart_common.info.erasesz / nandpart_common.info.writesz;
-	for (page = 0; page < npages; page++) {
-		/* Read page metadata */
-		err = flashmng_readMeta(&nandpart_common.oid, &nandpart_common.info, buff, srcBlock * npages + page);
-		if (err < 0) {
-			return err;
-		}
+	for (i = 0; i < offsetof(nandpart_journal_t, checksum); i++) {
+		checksum = (checksum << 1 | checksum >> 31) + data[i];
+	}
 
-		/* Check for clean page metadata */
-		for (i = 0; i < nandpart_common.info.oobsz; i++) {
-			if (buff[i] != 0xff) {
-				break;
-			}
+	return checksum ^ 0xffffffff;
+}
+
+
+static int nandpart_journalLoad(void)
+{
+	nandpart_journal_t rec[2];
+	ssize_t len;
+	int i;
+
+	nandpart_common.jvalid = 0;
+
+	if (lseek(nandpart_common.journal, 0, SEEK_SET) < 0) {
+		return -errno;
+	}
+
+	len = read(nandpart_common.journal, rec, sizeof(rec));
+	if (len < 0) {
+		return -errno;
+	}
+
+	for (i = 0; i < len / (ssize_t)sizeof(rec[0]); i++) {
+		if ((rec[i].magic != JOURNAL_MAGIC) || (rec[i].checksum != nandpart_journalChecksum(&rec[i]))) {
+			continue;
 		}
 
-		/* Don't write clean page metadata (assume erased) */
-		if (i < nandpart_common.info.oobsz) {
-			err = flashmng_writeMeta(&nandpart_common.oid, &nandpart_common.info, buff, dstBlock * npages + page);
-			if (err < 0) {
-				return err;
-			}
+		if ((nandpart_common.jvalid == 0) || ((int32_t)(rec[i].seq - nandpart_common.jrec.seq) > 0)) {
+			nandpart_common.jrec = rec[i];
+			nandpart_common.jvalid = 1;
 		}
+	}
+
+	return EOK;
+}
+
+
+static int nandpart_journalWrite(uint32_t state, uint32_t src, uint32_t dst, uint32_t end)
+{
+	nandpart_journal_t *rec = &nandpart_common.jrec;
+
+	rec->magic = JOURNAL_MAGIC;
+	rec->seq++;
+	rec->state = state;
+	rec->src = src;
+	rec->dst = dst;
+	rec->end = end;
+	rec->checksum = nandpart_journalChecksum(rec);
+
+	/* Without journal file the record only holds move state */
+	if (nandpart_common.journal < 0) {
+		return EOK;
+	}
+
+	/* Previous record is kept intact in the other slot */
+	if (lseek(nandpart_common.journal, (rec->seq % 2) * sizeof(*rec), SEEK_SET) < 0) {
+		return -errno;
+	}
+
+	if (write(nandpart_common.journal, rec, sizeof(*rec)) != sizeof(*rec)) {
+		return -EIO;
+	}
+
+	if (fsync(nandpart_common.journal) < 0) {
+		return -errno;
+	}
+	nandpart_common.jvalid = 1;
+
+	return EOK;
+}
+
+
+/* Records copy progress, progress of nested copies (bad block shifts, reverts) isn't recorded */
+static int nandpart_journalCheckpoint(uint32_t src, uint32_t dst)
+{
+	if ((nandpart_common.journal < 0) || (nandpart_common.jrec.state != journal_copy)) {
+		return EOK;
+	}
+
+	return nandpart_journalWrite(journal_copy, src, dst, nandpart_common.jrec.end);
+}
+
+
+static int nandpart_journalClear(void)
+{
+	if (nandpart_common.journal < 0) {
+		return EOK;
+	}
+	nandpart_common.jvalid = 0;
+
+	if (ftruncate(nandpart_common.journal, 0) < 0) {
+		return -errno;
+	}
+
+	if (fsync(nandpart_common.journal) < 0) {
+		return -errno;
+	}
+
+	return EOK;
+}
+
+
+static int nandpart_isErased(const unsigned char *buff, size_t size)
+{
+	const uint32_t *words = (const uint32_t *)buff;
+	size_t i;
 
-		/* Read page data */
-		if (lseek(nandpart_common.fd, (off_t)(srcBlock * npages + page) * nandpart_common.info.writesz, SEEK_SET) < 0) {
-			return -errno;
+	for (i = 0; i < size / sizeof(*words); i++) {
+		if (words[i] != 0xffffffff) {
+			return 0;
 		}
+	}
 
-		if (read(nandpart_common.fd, buff, nandpart_common.info.writesz) != nandpart_common.info.writesz) {
-			return -EIO;
+	for (i *= sizeof(*words); i < size; i++) {
+		if (buff[i] != 0xff) {
+			return 0;
 		}
+	}
 
-		/* Check for clean page data */
-		for (i = 0; i < nandpart_common.info.writesz; i++) {
-			if (buff[i] != 0xff) {
-				break;
+	return 1;
+}
+
+
+/* Writes data of pages [start, end) of the block at once */
+static int nandpart_writePages(unsigned int dstBlock, unsigned int start, unsigned int end, const unsigned char *data)
+{
+	unsigned int npages = nandpart_common.info.erasesz / nandpart_common.info.writesz;
+	size_t size = (end - start) * nandpart_common.info.writesz;
+
+	if (start == end) {
+		return EOK;
+	}
+
+	if (lseek(nandpart_common.fd, (off_t)(dstBlock * npages + start) * nandpart_common.info.writesz, SEEK_SET) < 0) {
+		return -errno;
+	}
+
+	if (write(nandpart_common.fd, data + start * nandpart_common.info.writesz, size) != size) {
+		return -EIO;
+	}
+
+	return EOK;
+}
+
+
+/* Copies erase block, buff has to fit erase block data followed by metadata of all its pages */
+static int nandpart_copyBlock(unsigned int srcBlock, unsigned int dstBlock, unsigned char *buff)
+{
+	unsigned int page, start, npages;
+	unsigned char *meta;
+	int err;
+
+	npages = nandpart_common.info.erasesz / nandpart_common.info.writesz;
+	meta = buff + nandpart_common.info.erasesz;
+
+	/* Read block data and metadata */
+	if (lseek(nandpart_common.fd, (off_t)srcBlock * nandpart_common.info.erasesz, SEEK_SET) < 0) {
+		return -errno;
+	}
+
+	if (read(nandpart_common.fd, buff, nandpart_common.info.erasesz) != nandpart_common.info.erasesz) {
+		return -EIO;
+	}
+
+	err = flashmng_readMetaPages(&nandpart_common.oid, &nandpart_common.info, meta, srcBlock * npages, npages);
+	if (err < 0) {
+		return err;
+	}
+
+	/* Write runs of pages with data, clean pages are skipped (assume erased), pages are programmed in order */
+	for (page = start = 0; page < npages; page++) {
+		if (!nandpart_isErased(meta + page * nandpart_common.info.oobsz, nandpart_common.info.oobsz)) {
+			err = nandpart_writePages(dstBlock, start, page, buff);
+			if (err < 0) {
+				return err;
 			}
-		}
+			start = page;
 
-		/* Don't write clean page data (assume erased) */
-		if (i < nandpart_common.info.writesz) {
-			if (lseek(nandpart_common.fd, (off_t)(dstBlock * npages + page) * nandpart_common.info.writesz, SEEK_SET) < 0) {
-				return -errno;
+			err = flashmng_writeMeta(&nandpart_common.oid, &nandpart_common.info, meta + page * nandpart_common.info.oobsz, dstBlock * npages + page);
+			if (err < 0) {
+				return err;
 			}
+		}
 
-			if (write(nandpart_common.fd, buff, nandpart_common.info.writesz) != nandpart_common.info.writesz) {
-				return -EIO;
+		if (nandpart_isErased(buff + page * nandpart_common.info.writesz, nandpart_common.info.writesz)) {
+			err = nandpart_writePages(dstBlock, start, page, buff);
+			if (err < 0) {
+				return err;
 			}
+			start = page + 1;
 		}
 	}
 
-	return EOK;
+	return nandpart_writePages(dstBlock, start, npages, buff);
 }
 
 
@@ -330,6 +514,11 @@ static int nandpart_copyBackward(unsigned int srcStart, unsigned int srcEnd, uns
 		/* Update last copied destination block */
 		if (dst != NULL) {
 			*dst = dstEnd - 1;
+
+			err = nandpart_journalCheckpoint(srcEnd - 1, dstEnd - 1);
+			if (err < 0) {
+				break;
+			}
 		}
 	}
 
@@ -344,6 +533,14 @@ static int nandpart_copyForward(unsigned int srcStart, unsigned int srcEnd, unsi
 	for (; (err = nandpart_nextBlock(&srcStart, srcEnd)) == 0; srcStart++, dstStart++) {
 		for (; (err = nandpart_nextBlock(&dstStart, dstEnd)) == 0; dstStart++) {
 			if (dstStart == srcStart) {
+				/* Remaining blocks are in place */
+				if (src != NULL) {
+					*src = srcEnd - 1;
+				}
+
+				if (dst != NULL) {
+					*dst = srcEnd - 1;
+				}
 				return EOK;
 			}
 
@@ -382,6 +579,11 @@ static int nandpart_copyForward(unsigned int srcStart, unsigned int srcEnd, unsi
 		/* Update last copied destination block */
 		if (dst != NULL) {
 			*dst = dstStart;
+
+			err = nandpart_journalCheckpoint(srcStart + 1, dstStart + 1);
+			if (err < 0) {
+				break;
+			}
 		}
 	}
 
@@ -441,21 +643,35 @@ static int nandpart_eraseBlocks(unsigned int start, unsigned int size, int markC
 }
 
 
-static int nandpart_copyBackwardSafe(unsigned int srcStart, unsigned int srcEnd, unsigned int dstStart, unsigned int dstEnd, unsigned int maxEnd, unsigned char *buff, int markClean)
+/* Copies blocks backward, copying continues from src and dst ends (resumed move) */
+static int nandpart_copyBackwardSafe(unsigned int srcStart, unsigned int srcEnd, unsigned int dstStart, unsigned int dstEnd, unsigned int maxEnd, unsigned int src, unsigned int dst, unsigned char *buff, int markClean)
 {
-	unsigned int src, dst, osrcEnd, odstEnd;
+	unsigned int osrcEnd, odstEnd;
 	int err;
 
-	src = osrcEnd = srcEnd;
-	dst = odstEnd = dstEnd;
+	osrcEnd = srcEnd;
+	odstEnd = dstEnd;
+	srcEnd = src;
+	dstEnd = dst;
 
 	for (; (err = nandpart_copyBackward(srcStart, srcEnd, dstStart, dstEnd, buff, &src, &dst, 1)) == -EBADMSG;) {
+		/* Shift of copied blocks can't be resumed */
+		err = nandpart_journalWrite(journal_shift, src, dst, odstEnd);
+		if (err < 0) {
+			break;
+		}
+
 		err = nandpart_shiftRightSafe(&dst, &odstEnd, maxEnd, buff);
 		if (err < 0) {
 			break;
 		}
 		srcEnd = src;
 		dstEnd = dst;
+
+		err = nandpart_journalWrite(journal_copy, srcEnd, dstEnd, odstEnd);
+		if (err < 0) {
+			break;
+		}
 	}
 
 	/* Copy failed, try to revert it */
@@ -471,12 +687,16 @@ static int nandpart_copyBackwardSafe(unsigned int srcStart, unsigned int srcEnd,
 }
 
 
-static int nandpart_copyForwardSafe(unsigned int srcStart, unsigned int srcEnd, unsigned int dstStart, unsigned int dstEnd, unsigned char *buff, int markClean)
+/* Copies blocks forward, copying continues from src and dst blocks (resumed move) */
+static int nandpart_copyForwardSafe(unsigned int srcStart, unsigned int srcEnd, unsigned int dstStart, unsigned int dstEnd, unsigned int src, unsigned int dst, unsigned char *buff, int markClean)
 {
-	unsigned int src, dst;
 	int err;
 
-	err = nandpart_copyForward(srcStart, srcEnd, dstStart, dstEnd, buff, &src, &dst, 0);
+	/* Track last copied blocks */
+	src--;
+	dst--;
+
+	err = nandpart_copyForward(src + 1, srcEnd, dst + 1, dstEnd, buff, &src, &dst, 0);
 	/* Copy failed, try to revert it */
 	if (err < 0) {
 		nandpart_copyBackward(dstStart, dst + 1, srcStart, src + 1, buff, NULL, NULL, 1);
@@ -507,50 +727,99 @@ static int nandpart_movePart(const ptable_part_t *part, const ptable_part_t *mod
 {
 	unsigned int i, n, srcStart, srcEnd, dstStart, dstEnd, end;
 	int err, markClean = (mod->type == ptable_jffs2) ? 1 : 0;
+	nandpart_journal_t *jrec = &nandpart_common.jrec;
 	uint8_t *buff;
 
-	buff = malloc(nandpart_common.info.writesz);
-	if (buff == NULL) {
-		return -ENOMEM;
-	}
-
 	srcStart = part->offset / nandpart_common.info.erasesz;
 	srcEnd = (part->offset + part->size) / nandpart_common.info.erasesz;
 
 	dstStart = mod->offset / nandpart_common.info.erasesz;
 	dstEnd = (mod->offset + mod->size) / nandpart_common.info.erasesz;
 
-	/* Copy backwards */
-	if ((dstStart > srcStart) && (dstStart < srcEnd)) {
-		/* Count number of blocks to copy */
-		err = nandpart_countBlocks(srcStart, srcEnd);
-		if (err <= 0) {
-			free(buff);
-			return err;
+	/* Resume interrupted move */
+	if (nandpart_common.jvalid != 0) {
+		if ((memcmp(&jrec->part, part, sizeof(*part)) != 0) || (memcmp(&jrec->mod, mod, sizeof(*mod)) != 0)) {
+			fprintf(stderr, "nandpart: journal holds interrupted move of '%s' partition, repeat it first\n", (const char *)jrec->part.name);
+			return -EBUSY;
 		}
-		n = err;
 
-		/* Find end block of destination area */
-		end = dstStart;
-		for (i = 0; i < n; i++, end++) {
-			err = nandpart_nextBlock(&end, dstEnd);
-			if (err != 0) {
-				if (err == 1) {
-					err = -ENOSPC;
+		if (jrec->state == journal_done) {
+			return EOK;
+		}
+
+		if (jrec->state == journal_shift) {
+			fprintf(stderr, "nandpart: move of '%s' partition was interrupted during bad block shift and can't be resumed\n", (const char *)part->name);
+			return -EIO;
+		}
+		printf("nandpart: resuming move of '%s' partition\n", (const char *)part->name);
+	}
+
+	buff = malloc(nandpart_common.info.erasesz + (nandpart_common.info.erasesz / nandpart_common.info.writesz) * nandpart_common.info.oobsz);
+	if (buff == NULL) {
+		return -ENOMEM;
+	}
+
+	/* Copy backwards */
+	if ((dstStart > srcStart) && (dstStart < srcEnd)) {
+		if (nandpart_common.jvalid == 0) {
+			/* Count number of blocks to copy */
+			err = nandpart_countBlocks(srcStart, srcEnd);
+			if (err <= 0) {
+				free(buff);
+				return err;
+			}
+			n = err;
+
+			/* Find end block of destination area */
+			end = dstStart;
+			for (i = 0; i < n; i++, end++) {
+				err = nandpart_nextBlock(&end, dstEnd);
+				if (err != 0) {
+					if (err == 1) {
+						err = -ENOSPC;
+					}
+					free(buff);
+					return err;
 				}
+			}
+
+			end++;
+			jrec->part = *part;
+			jrec->mod = *mod;
+			err = nandpart_journalWrite(journal_copy, srcEnd, end, end);
+			if (err < 0) {
 				free(buff);
 				return err;
 			}
 		}
 
-		err = nandpart_copyBackwardSafe(srcStart, srcEnd, dstStart, ++end, dstEnd, buff, markClean);
+		err = nandpart_copyBackwardSafe(srcStart, srcEnd, dstStart, jrec->end, dstEnd, jrec->src, jrec->dst, buff, markClean);
 	}
 	/* Copy forwards */
 	else {
-		err = nandpart_copyForwardSafe(srcStart, srcEnd, dstStart, dstEnd, buff, markClean);
+		if (nandpart_common.jvalid == 0) {
+			jrec->part = *part;
+			jrec->mod = *mod;
+			err = nandpart_journalWrite(journal_copy, srcStart, dstStart, dstEnd);
+			if (err < 0) {
+				free(buff);
+				return err;
+			}
+		}
+
+		err = nandpart_copyForwardSafe(srcStart, srcEnd, dstStart, dstEnd, jrec->src, jrec->dst, buff, markClean);
 	}
 	free(buff);
 
+	/* Partition moved, only partition table update is left */
+	if (err >= 0) {
+		err = nandpart_journalWrite(journal_done, jrec->src, jrec->dst, jrec->end);
+	}
+	/* Failed move has been reverted */
+	else {
+		nandpart_journalClear();
+	}
+
 	return err;
 }
 
@@ -749,6 +1018,10 @@ static void nandpart_done(void)
 		fsync(nandpart_common.fd);
 		close(nandpart_common.fd);
 	}
+
+	if (nandpart_common.journal >= 0) {
+		close(nandpart_common.journal);
+	}
 }
 
 
@@ -760,6 +1033,167 @@ static int nandpart_umountPart(const ptable_part_t *part)
 }
 
 
+/* Appends nodes of src list to dst list */
+static void nandpart_mergeList(nandpart_list_t *dst, nandpart_list_t *src)
+{
+	nandpart_node_t *node;
+
+	while (src->size > 0) {
+		node = src->head;
+		LIST_REMOVE(&src->head, node);
+		src->size--;
+		LIST_ADD(&dst->head, node);
+		dst->size++;
+	}
+}
+
+
+/* Prints estimate of partition move, returns number of blocks to copy */
+static int nandpart_estimateMove(const ptable_part_t *part, const ptable_part_t *mod, unsigned int *erase)
+{
+	unsigned int srcStart, srcEnd, dstStart, dstEnd;
+	int n = 0;
+
+	srcStart = part->offset / nandpart_common.info.erasesz;
+	srcEnd = (part->offset + part->size) / nandpart_common.info.erasesz;
+	dstStart = mod->offset / nandpart_common.info.erasesz;
+	dstEnd = (mod->offset + mod->size) / nandpart_common.info.erasesz;
+
+	/* Blocks stay in place, only extended area is erased */
+	if (srcStart == dstStart) {
+		*erase = (dstEnd > srcEnd) ? dstEnd - srcEnd : 0;
+		printf("\tmodify '%s' in place: blocks %u-%u -> %u-%u, erase %u\n", (const char *)mod->name, srcStart, srcEnd, dstStart, dstEnd, *erase);
+		return 0;
+	}
+
+	/* Only good blocks are copied, whole destination area is erased */
+	if (nandpart_common.output == NULL) {
+		n = nandpart_countBlocks(srcStart, srcEnd);
+		if (n < 0) {
+			return n;
+		}
+	}
+	*erase = dstEnd - dstStart;
+	printf("\tmove '%s': blocks %u-%u -> %u-%u, copy %d, erase %u\n", (const char *)mod->name, srcStart, srcEnd, dstStart, dstEnd, n, *erase);
+
+	return n;
+}
+
+
+/* Validates all actions against final layout and estimates blocks to copy and erase before anything is applied */
+static int nandpart_validate(const ptable_t *ptable)
+{
+	unsigned int i, erase, nerase = 0, ncopy = 0, npages;
+	nandpart_list_t order = { NULL, 0 };
+	nandpart_node_t *node;
+	ptable_part_t *part;
+	unsigned long long us;
+	ptable_t *layout;
+	int err = EOK;
+
+	layout = malloc(nandpart_common.info.writesz);
+	if (layout == NULL) {
+		err = -ENOMEM;
+		fprintf(stderr, "nandpart: failed to allocate partition table buffer, err: %s\n", strerror(err));
+		return err;
+	}
+	memcpy(layout, ptable, ptable_size(ptable->count));
+
+	printf("nandpart: actions to apply:\n");
+
+	/* Remove partitions */
+	node = nandpart_common.rem.head;
+	for (i = 0; i < nandpart_common.rem.size; i++, node = node->next) {
+		part = nandpart_findPart(layout, (const char *)node->part.name);
+		if (part == NULL) {
+			err = -EINVAL;
+			fprintf(stderr, "nandpart: no existing '%s' partition to remove, err: %s\n", (const char *)node->part.name, strerror(err));
+			free(layout);
+			return err;
+		}
+		printf("\tremove '%s'\n", (const char *)part->name);
+
+		memmove(part, part + 1, (layout->count - (part - layout->parts + 1)) * sizeof(*part));
+		layout->count--;
+	}
+
+	/* Order partitions to modify, destination of each one can't overlap partitions left to move */
+	while (nandpart_common.mod.size > 0) {
+		node = nandpart_common.mod.head;
+		for (i = 0; i < nandpart_common.mod.size; i++, node = node->next) {
+			if (nandpart_verifyPart(layout, &node->part) == EOK) {
+				break;
+			}
+		}
+
+		if (i >= nandpart_common.mod.size) {
+			err = -EINVAL;
+			fprintf(stderr, "nandpart: no valid order of partitions to modify, err: %s\n", strerror(err));
+			break;
+		}
+
+		part = nandpart_findPart(layout, (const char *)node->part.name);
+		if (part == NULL) {
+			err = -EINVAL;
+			fprintf(stderr, "nandpart: no existing '%s' partition to modify, err: %s\n", (const char *)node->part.name, strerror(err));
+			break;
+		}
+
+		LIST_REMOVE(&nandpart_common.mod.head, node);
+		nandpart_common.mod.size--;
+		LIST_ADD(&order.head, node);
+		order.size++;
+
+		if ((part->offset != node->part.offset) || (part->size != node->part.size) || (part->type != node->part.type)) {
+			err = nandpart_estimateMove(part, &node->part, &erase);
+			if (err < 0) {
+				break;
+			}
+			ncopy += err;
+			nerase += erase;
+			err = EOK;
+
+			part->offset = node->part.offset;
+			part->size = node->part.size;
+			part->type = node->part.type;
+		}
+	}
+
+	/* Process modifications in validated order */
+	nandpart_mergeList(&order, &nandpart_common.mod);
+	nandpart_common.mod = order;
+
+	/* Add partitions */
+	node = nandpart_common.add.head;
+	for (i = 0; (err == EOK) && (i < nandpart_common.add.size); i++, node = node->next) {
+		if ((ptable_size(layout->count + 1) > nandpart_common.info.writesz) || (nandpart_findPart(layout, (const char *)node->part.name) != NULL) ||
+				(nandpart_verifyPart(layout, &node->part) != EOK)) {
+			err = -EINVAL;
+			fprintf(stderr, "nandpart: invalid partition '%s' to add, err: %s\n", (const char *)node->part.name, strerror(err));
+			break;
+		}
+		printf("\tadd '%s': blocks %u-%u\n", (const char *)node->part.name, node->part.offset / nandpart_common.info.erasesz, (node->part.offset + node->part.size) / nandpart_common.info.erasesz);
+
+		layout->parts[layout->count++] = node->part;
+	}
+
+	if (err == EOK) {
+		npages = nandpart_common.info.erasesz / nandpart_common.info.writesz;
+		us = (unsigned long long)ncopy * npages * (EST_PAGE_READ_US + EST_PAGE_PROG_US) + (unsigned long long)nerase * EST_BLOCK_ERASE_US;
+		printf("nandpart: blocks to copy: %u (%llu KiB), blocks to erase: %u, estimated time: %llu s\n",
+			ncopy, (unsigned long long)ncopy * nandpart_common.info.erasesz / 1024, nerase, (us + 999999) / 1000000);
+
+		if (nandpart_common.dryrun != 0) {
+			printf("nandpart: resulting partition table:\n");
+			nandpart_printPtable(layout);
+		}
+	}
+	free(layout);
+
+	return err;
+}
+
+
 static int nandpart_processActions(ptable_t *ptable)
 {
 	nandpart_node_t *node;
@@ -802,15 +1236,17 @@ static int nandpart_processActions(ptable_t *ptable)
 			return err;
 		}
 
-		memcpy(part, part + sizeof(*part), (ptable->count - (part - ptable->parts + 1)) * sizeof(*part));
-		ptable->count--;
-
 		if (nandpart_common.output == NULL) {
 			err = nandpart_umountPart(part);
 			if (err < 0) {
 				/* TODO: handle umount errors, ignore for now */
 			}
+		}
+
+		memmove(part, part + 1, (ptable->count - (part - ptable->parts + 1)) * sizeof(*part));
+		ptable->count--;
 
+		if (nandpart_common.output == NULL) {
 			err = nandpart_writePtable(nandpart_common.output, ptable);
 			if (err < 0) {
 				free(node);
@@ -876,6 +1312,13 @@ static int nandpart_processActions(ptable_t *ptable)
 					return err;
 				}
 
+				err = nandpart_journalClear();
+				if (err < 0) {
+					fprintf(stderr, "nandpart: failed to clear move journal, err: %s\n", strerror(err));
+					free(node);
+					return err;
+				}
+
 				/* Modified partition on device, EAGAIN means NAND server restart required */
 				ret = -EAGAIN;
 			}
@@ -1026,10 +1469,14 @@ static int nandpart_run(void)
 	}
 	/* Process actions */
 	else {
-		err = nandpart_processActions(ptable);
-		/* Save modified partition table file */
-		if ((err >= 0) && (nandpart_common.output != NULL)) {
-			err = nandpart_writePtable(nandpart_common.output, ptable);
+		err = nandpart_validate(ptable);
+		/* Dry run only validates actions and prints estimate */
+		if ((err >= 0) && (nandpart_common.dryrun == 0)) {
+			err = nandpart_processActions(ptable);
+			/* Save modified partition table file */
+			if ((err >= 0) && (nandpart_common.output != NULL)) {
+				err = nandpart_writePtable(nandpart_common.output, ptable);
+			}
 		}
 	}
 	free(ptable);
@@ -1040,7 +1487,7 @@ static int nandpart_run(void)
 
 static int nandpart_init(int argc, char *argv[])
 {
-	const char *arg, *input = NULL, *output = NULL, *update = NULL;
+	const char *arg, *input = NULL, *output = NULL, *update = NULL, *journal = NULL;
 	nandpart_node_t *node;
 	int c, err;
 	char *dev;
@@ -1048,11 +1495,12 @@ static int nandpart_init(int argc, char *argv[])
 	nandpart_common.input = NULL;
 	nandpart_common.output = NULL;
 	nandpart_common.update = NULL;
+	nandpart_common.journal = -1;
 	nandpart_common.add.head = NULL;
 	nandpart_common.mod.head = NULL;
 	nandpart_common.rem.head = NULL;
 
-	while ((c = getopt(argc, argv, "i:o:u:a:m:r:h")) != -1) {
+	while ((c = getopt(argc, argv, "i:o:u:j:na:m:r:h")) != -1) {
 		switch (c) {
 			case 'i':
 				input = optarg;
@@ -1066,6 +1514,14 @@ static int nandpart_init(int argc, char *argv[])
 				update = optarg;
 				break;
 
+			case 'j':
+				journal = optarg;
+				break;
+
+			case 'n':
+				nandpart_common.dryrun = 1;
+				break;
+
 			case 'a':
 				node = calloc(1, sizeof(nandpart_node_t));
 				if (node == NULL) {
@@ -1196,6 +1652,25 @@ static int nandpart_init(int argc, char *argv[])
 		}
 	}
 
+	if (journal != NULL) {
+		nandpart_common.journal = open(journal, O_RDWR | O_CREAT, 0644);
+		if (nandpart_common.journal < 0) {
+			err = -errno;
+			fprintf(stderr, "nandpart: failed to open %s journal file, err: %s\n", journal, strerror(err));
+			return err;
+		}
+
+		err = nandpart_journalLoad();
+		if (err < 0) {
+			fprintf(stderr, "nandpart: failed to read %s journal file, err: %s\n", journal, strerror(err));
+			return err;
+		}
+
+		if (nandpart_common.jvalid != 0) {
+			printf("nandpart: journal holds interrupted move of '%s' partition\n", (const char *)nandpart_common.jrec.part.name);
+		}
+	}
+
 	/* Convert partitions offset and size unit from eraseblocks to bytes */
 	node = nandpart_common.mod.head;
 	if (node != NULL) {
@@ -24,9 +24,24 @@
 #include "flashmng.h"
 
 
+/* Bad block cache of a device, filled on demand */
+typedef struct _flashmng_bbt_t {
+	struct _flashmng_bbt_t *next;
+	oid_t oid;
+	unsigned int gen;     /* Cache generation, entries are stale if it differs from the current one */
+	unsigned int erasesz;
+	unsigned int nblocks;
+	uint32_t *known;      /* Blocks already queried */
+	uint32_t *bad;        /* Bad blocks */
+} flashmng_bbt_t;
+
+
 static struct {
 	oid_t oid;
 	flashsrv_info_t info;
+	int nobatch;
+	flashmng_bbt_t *bbt;
+	unsigned int gen;
 } flashmng_common;
 
 
@@ -65,6 +80,30 @@ int flashmng_readraw(oid_t oid, off_t addr, void *data, size_t size)
 }
 
 
+int flashmng_readrawpages(oid_t oid, off_t addr, void *data, size_t pagesz, unsigned int npages)
+{
+	unsigned int i;
+	int err;
+
+	if ((npages > 1) && !flashmng_common.nobatch) {
+		if (flashmng_readraw(oid, addr, data, npages * pagesz) == npages * pagesz)
+			return npages;
+	}
+
+	/* End of partition or multi-page read not supported, continue page by page */
+	for (i = 0; i < npages; i++) {
+		err = flashmng_readraw(oid, addr + i * pagesz, (char *)data + i * pagesz, pagesz);
+		if (err != pagesz)
+			return (i > 0) ? i : ((err < 0) ? err : -EIO);
+	}
+
+	if (npages > 1)
+		flashmng_common.nobatch = 1;
+
+	return npages;
+}
+
+
 static int write_ex(oid_t oid, uint32_t addr, const void *data, size_t size, int type)
 {
 	msg_t msg = { 0 };
@@ -79,8 +118,11 @@ static int write_ex(oid_t oid, uint32_t addr, const void *data, size_t size, int
 	idevctl->write.address = addr;
 	idevctl->write.size = size;
 
-	if (((err = msgSend(oid.port, &msg)) < 0) || ((err = msg.o.err) < 0))
+	if (((err = msgSend(oid.port, &msg)) < 0) || ((err = msg.o.err) < 0)) {
+		/* Failed program may have marked the block as bad */
+		flashmng_bbtInvalidate();
 		return err;
+	}
 
 	if (err != size)
 		return -EIO;
@@ -122,8 +164,11 @@ int flashmng_erase(oid_t oid, unsigned int start, unsigned int size)
 	idevctl->erase.address = start * info->erasesz;
 	idevctl->erase.size = size * info->erasesz;
 
-	if (((err = msgSend(oid.port, &msg)) < 0) || ((err = msg.o.err) < 0))
+	if (((err = msgSend(oid.port, &msg)) < 0) || ((err = msg.o.err) < 0)) {
+		/* Failed erase may have marked blocks as bad */
+		flashmng_bbtInvalidate();
 		return err;
+	}
 
 	return EOK;
 }
@@ -180,13 +225,65 @@ int flashmng_checkbad(oid_t oid)
 }
 
 
+void flashmng_bbtInvalidate(void)
+{
+	flashmng_common.gen++;
+}
+
+
+static flashmng_bbt_t *flashmng_bbtGet(oid_t oid)
+{
+	flashmng_bbt_t *bbt;
+	flashsrv_info_t *info;
+	size_t words;
+
+	for (bbt = flashmng_common.bbt; bbt != NULL; bbt = bbt->next) {
+		if ((bbt->oid.port == oid.port) && (bbt->oid.id == oid.id))
+			break;
+	}
+
+	if (bbt == NULL) {
+		if ((info = flashmng_info(oid)) == NULL)
+			return NULL;
+
+		words = (info->size / info->erasesz + 31) / 32;
+		if ((bbt = malloc(sizeof(*bbt) + 2 * words * sizeof(uint32_t))) == NULL)
+			return NULL;
+
+		bbt->oid = oid;
+		bbt->erasesz = info->erasesz;
+		bbt->nblocks = info->size / info->erasesz;
+		bbt->known = (uint32_t *)(bbt + 1);
+		bbt->bad = bbt->known + words;
+		bbt->gen = flashmng_common.gen - 1;
+		bbt->next = flashmng_common.bbt;
+		flashmng_common.bbt = bbt;
+	}
+
+	if (bbt->gen != flashmng_common.gen) {
+		memset(bbt->known, 0, (bbt->nblocks + 31) / 32 * sizeof(uint32_t));
+		bbt->gen = flashmng_common.gen;
+	}
+
+	return bbt;
+}
+
+
 int flashmng_isbad(oid_t oid, unsigned int block)
 {
 	msg_t msg = { 0 };
 	flash_i_devctl_t *idevctl = (flash_i_devctl_t *)msg.i.raw;
+	flashmng_bbt_t *bbt;
 	flashsrv_info_t *info;
 	int err;
 
+	/* Cache miss or allocation failure falls back to the device query */
+	bbt = flashmng_bbtGet(oid);
+	if ((bbt != NULL) && (block < bbt->nblocks)) {
+		if (bbt->known[block / 32] & (1u << (block % 32)))
+			return (bbt->bad[block / 32] >> (block % 32)) & 1;
+	}
+
 	if ((info = flashmng_info(oid)) == NULL)
 		return -EFAULT;
 
@@ -198,7 +295,15 @@ int flashmng_isbad(oid_t oid, unsigned int block)
 	if (((err = msgSend(oid.port, &msg)) < 0) || ((err = msg.o.err) < 0))
 		return err;
 
-	return msg.o.err;
+	if ((bbt != NULL) && (block < bbt->nblocks)) {
+		bbt->known[block / 32] |= 1u << (block % 32);
+		if (err > 0)
+			bbt->bad[block / 32] |= 1u << (block % 32);
+		else
+			bbt->bad[block / 32] &= ~(1u << (block % 32));
+	}
+
+	return err;
 }
 
 
@@ -25,6 +25,10 @@
 int flashmng_readraw(oid_t oid, off_t addr, void *data, size_t size);
 
 
+/* reads up to npages raw pages in a single request if possible, returns number of pages read */
+int flashmng_readrawpages(oid_t oid, off_t addr, void *data, size_t pagesz, unsigned int npages);
+
+
 int flashmng_writeraw(oid_t oid, unsigned int page, const void *data, size_t size);
 
 
@@ -34,9 +38,14 @@ int flashmng_erase(oid_t oid, unsigned int start, unsigned int end);
 int flashmng_checkbad(oid_t oid);
 
 
+/* returns cached bad block state, device is queried only on cache miss */
 int flashmng_isbad(oid_t oid, unsigned int block);
 
 
+/* drops cached bad block state of all devices */
+void flashmng_bbtInvalidate(void);
+
+
 /* write JFFS2 clean block markers */
 int flashmng_cleanMarkers(oid_t oid, unsigned int start, unsigned int size);
 
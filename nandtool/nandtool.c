@@ -23,6 +23,7 @@
 #include <sys/file.h>
 #include <sys/msg.h>
 #include <sys/stat.h>
+#include <sys/threads.h>
 
 #include "flashmng.h"
 #ifdef HAS_BCB
@@ -31,6 +32,16 @@
 
 #define SCAN_DEVICES_MAX_CNT 4
 
+#define FLASH_RING_SZ  4
+#define FLASH_STACK_SZ 4096
+
+/* Sparse dump format */
+#define SPARSE_MAGIC    0x5053544e /* "NTSP" */
+#define SPARSE_VERSION  1
+#define SPARSE_FLAG_RAW 0x1
+
+enum { sparse_data = 0, sparse_erased, sparse_bad, sparse_end };
+
 static struct {
 	oid_t oid;
 	int fd;
@@ -39,106 +50,416 @@ static struct {
 } nandtool_common;
 
 
+/* Sparse dump header, followed by records */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t flags;
+	uint32_t pagesz;
+	uint32_t npages; /* Pages per erase block */
+	uint32_t start;  /* First dumped block, image has to be flashed from the same block */
+} nandtool_sparsehdr_t;
+
+
+/* Sparse dump record, sparse_data record is followed by count pages, sparse_end record terminates a complete dump */
+typedef struct {
+	uint32_t type;
+	uint32_t count; /* Number of pages, number of blocks for sparse_bad and total number of dumped blocks for sparse_end */
+} nandtool_sparserec_t;
+
+
+/* Image file read-ahead ring of erase block sized buffers */
+typedef struct {
+	int fd;
+	size_t bufsz;
+	unsigned int pagesz;
+	char *bufs[FLASH_RING_SZ];
+	ssize_t lens[FLASH_RING_SZ]; /* Data length, 0 on EOF, negative error */
+	off_t pos[FLASH_RING_SZ];    /* Image file position after buffer fill */
+	int sparse;
+	nandtool_sparserec_t rec;    /* Current sparse record */
+	unsigned int spages;         /* Pages expanded from sparse records */
+	unsigned int sblocks;        /* Bad blocks read from sparse records */
+	int send;                    /* End record has been read */
+	unsigned int head;
+	unsigned int count;
+	int stop;
+	handle_t lock;
+	handle_t cond;
+} nandtool_ring_t;
+
+
+static ssize_t nandtool_readFull(int fd, void *buf, size_t size)
+{
+	size_t len = 0;
+	ssize_t err;
+
+	while (len < size) {
+		err = read(fd, (char *)buf + len, size - len);
+		if (err < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		else if (err == 0) {
+			break;
+		}
+		len += err;
+	}
+
+	return len;
+}
+
+
+/* Expands sparse records into next erase block, bad block records are skipped */
+static ssize_t nandtool_flashFillSparse(nandtool_ring_t *ring, char *buf)
+{
+	nandtool_sparserec_t *rec = &ring->rec;
+	const unsigned int npages = ring->bufsz / ring->pagesz;
+	size_t len = 0, n;
+	ssize_t err;
+
+	while ((len < ring->bufsz) && !ring->send) {
+		if (rec->count == 0) {
+			/* Image without the end record is truncated */
+			if ((err = nandtool_readFull(ring->fd, rec, sizeof(*rec))) != sizeof(*rec)) {
+				return (err < 0) ? err : -EIO;
+			}
+
+			if (rec->type > sparse_end) {
+				return -EINVAL;
+			}
+
+			if (rec->type == sparse_end) {
+				if (((ring->spages % npages) != 0) || (ring->spages / npages + ring->sblocks != rec->count)) {
+					return -EIO;
+				}
+				ring->send = 1;
+				rec->count = 0;
+			}
+			/* Bad blocks have no data, target bad blocks are skipped while flashing */
+			else if (rec->type == sparse_bad) {
+				ring->sblocks += rec->count;
+				rec->count = 0;
+			}
+			continue;
+		}
+
+		n = (ring->bufsz - len) / ring->pagesz;
+		if (n > rec->count) {
+			n = rec->count;
+		}
+
+		if (rec->type == sparse_data) {
+			if ((err = nandtool_readFull(ring->fd, buf + len, n * ring->pagesz)) != n * ring->pagesz) {
+				return (err < 0) ? err : -EIO;
+			}
+		}
+		else {
+			memset(buf + len, 0xff, n * ring->pagesz);
+		}
+
+		rec->count -= n;
+		ring->spages += n;
+		len += n * ring->pagesz;
+	}
+
+	return len;
+}
+
+
+/* Reads next erase block from image, last page is padded with zeros */
+static ssize_t nandtool_flashFill(nandtool_ring_t *ring, char *buf)
+{
+	ssize_t len;
+
+	if (ring->sparse) {
+		return nandtool_flashFillSparse(ring, buf);
+	}
+
+	if ((len = nandtool_readFull(ring->fd, buf, ring->bufsz)) < 0) {
+		return len;
+	}
+
+	if ((len % ring->pagesz) != 0) {
+		memset(buf + len, 0, ring->pagesz - (len % ring->pagesz));
+	}
+
+	return len;
+}
+
+
+static void nandtool_flashReader(void *arg)
+{
+	nandtool_ring_t *ring = arg;
+	unsigned int idx;
+	ssize_t len;
+
+	mutexLock(ring->lock);
+	for (;;) {
+		while ((ring->count == FLASH_RING_SZ) && !ring->stop) {
+			condWait(ring->cond, ring->lock, 0);
+		}
+
+		if (ring->stop) {
+			break;
+		}
+
+		idx = (ring->head + ring->count) % FLASH_RING_SZ;
+		mutexUnlock(ring->lock);
+
+		len = nandtool_flashFill(ring, ring->bufs[idx]);
+		ring->pos[idx] = lseek(ring->fd, 0, SEEK_CUR);
+
+		mutexLock(ring->lock);
+		ring->lens[idx] = len;
+		ring->count++;
+		condBroadcast(ring->cond);
+
+		if (len <= 0) {
+			break;
+		}
+	}
+	mutexUnlock(ring->lock);
+
+	endthread();
+}
+
+
+/* Erased pages don't need to be written on previously erased blocks */
+static int nandtool_isErased(const char *buf, unsigned int size)
+{
+	const uint32_t *words = (const uint32_t *)buf;
+	unsigned int i;
+
+	for (i = 0; i < size / sizeof(*words); i++) {
+		if (words[i] != 0xffffffff) {
+			return 0;
+		}
+	}
+
+	for (i *= sizeof(*words); i < size; i++) {
+		if ((unsigned char)buf[i] != 0xff) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+
+static int nandtool_flashPage(const char *buf, unsigned int page, unsigned int pagesz, int raw)
+{
+	int err;
+
+	if (raw) {
+		if ((err = flashmng_writeraw(nandtool_common.oid, page, buf, pagesz)) < 0) {
+			fprintf(stderr, "nandtool: failed to write raw data to page %u, err: %d\n", page, err);
+			return err;
+		}
+	}
+	else {
+		if (lseek(nandtool_common.fd, (off_t)page * pagesz, SEEK_SET) < 0) {
+			err = -errno;
+			fprintf(stderr, "nandtool: failed to lseek to page %u, err: %d\n", page, err);
+			return err;
+		}
+
+		if (write(nandtool_common.fd, buf, pagesz) != pagesz) {
+			err = -errno;
+			flashmng_bbtInvalidate();
+			fprintf(stderr, "nandtool: failed to write data to page %u, err: %d\n", page, err);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+
 static int nandtool_flash(const char *path, unsigned int start, int raw)
 {
 	const flashsrv_info_t *info = nandtool_common.info;
 	const unsigned int npages = info->erasesz / info->writesz;
 	const unsigned int pagesz = raw ? info->writesz + info->metasz : info->writesz;
-	unsigned int page, block, boffs, offs = 0;
+	unsigned int i, page, block = start, skipped = 0;
 	unsigned int perc, oldperc = 0;
+	nandtool_ring_t ring = { 0 };
+	handle_t tid;
+	nandtool_sparsehdr_t hdr;
 	struct stat stat;
-	char *buff;
-	int fd, err;
+	void *stack = NULL;
+	ssize_t len;
+	off_t pos;
+	char *buf;
+	int err, threaded = 0;
 
 	if ((err = open(path, O_RDONLY)) < 0) {
 		fprintf(stderr, "nandtool: failed to open file %s, err: %d\n", path, err);
 		return err;
 	}
-	fd = err;
+	ring.fd = err;
+	ring.pagesz = pagesz;
+	ring.bufsz = npages * pagesz;
 
-	if ((buff = malloc(pagesz)) == NULL) {
-		err = -ENOMEM;
-		fprintf(stderr, "nandtool: failed to allocate buffer, err: %d\n", err);
-		close(fd);
+	if ((err = fstat(ring.fd, &stat)) < 0) {
+		fprintf(stderr, "nandtool: failed to stat file %s, err: %d\n", path, err);
+		close(ring.fd);
 		return err;
 	}
 
-	do {
-		if ((err = fstat(fd, &stat)) < 0) {
-			fprintf(stderr, "nandtool: failed to stat file %s, err: %d\n", path, err);
-			break;
+	/* Detect sparse dump, otherwise image is flashed verbatim */
+	if ((nandtool_readFull(ring.fd, &hdr, sizeof(hdr)) == sizeof(hdr)) && (hdr.magic == SPARSE_MAGIC)) {
+		if ((hdr.version != SPARSE_VERSION) || (hdr.pagesz != pagesz) || (hdr.npages != npages) || (!(hdr.flags & SPARSE_FLAG_RAW) != !raw)) {
+			fprintf(stderr, "nandtool: sparse image %s doesn't match device or %s mode\n", path, raw ? "raw" : "non-raw");
+			close(ring.fd);
+			return -EINVAL;
 		}
 
-		start *= npages;
-		while (offs < stat.st_size) {
-			page = start + (offs / pagesz);
-			block = page / npages;
+		/* Bad block records describe blocks starting from the dump start */
+		if (hdr.start != start) {
+			fprintf(stderr, "nandtool: sparse image %s was dumped from block %u, can't flash it from block %u\n", path, hdr.start, start);
+			close(ring.fd);
+			return -EINVAL;
+		}
 
-			if ((err = flashmng_isbad(nandtool_common.oid, block)) < 0) {
-				fprintf(stderr, "nandtool: failed to check block %u, err: %d\n", block, err);
-				break;
-			}
-			else if (err > 0) {
-				start++;
-				continue;
-			}
+		/* Reject truncated image before flashing, the number of blocks is checked when the end record is reached */
+		if ((lseek(ring.fd, -(off_t)sizeof(ring.rec), SEEK_END) < 0) || (nandtool_readFull(ring.fd, &ring.rec, sizeof(ring.rec)) != sizeof(ring.rec)) ||
+				(ring.rec.type != sparse_end) || (lseek(ring.fd, sizeof(hdr), SEEK_SET) < 0)) {
+			fprintf(stderr, "nandtool: sparse image %s is incomplete\n", path);
+			close(ring.fd);
+			return -EINVAL;
+		}
+		ring.rec.count = 0;
+		ring.sparse = 1;
+	}
+	else if (lseek(ring.fd, 0, SEEK_SET) < 0) {
+		err = -errno;
+		fprintf(stderr, "nandtool: failed to lseek file %s, err: %d\n", path, err);
+		close(ring.fd);
+		return err;
+	}
 
-			memset(buff, 0, pagesz);
-			for (boffs = 0; boffs < pagesz; boffs += err) {
-				if ((err = read(fd, buff + boffs, pagesz - boffs)) <= 0) {
-					if (err < 0) {
-						err = -errno;
-						fprintf(stderr, "nandtool: failed to read file %s, err: %d\n", path, err);
-					}
-					break;
-				}
-			}
+	for (i = 0; i < FLASH_RING_SZ; i++) {
+		if ((ring.bufs[i] = malloc(ring.bufsz)) == NULL) {
+			break;
+		}
+	}
 
-			if (err < 0)
-				break;
+	if (i < FLASH_RING_SZ) {
+		err = -ENOMEM;
+		fprintf(stderr, "nandtool: failed to allocate buffer, err: %d\n", err);
+		while (i > 0) {
+			free(ring.bufs[--i]);
+		}
+		close(ring.fd);
+		return err;
+	}
 
-			if (raw) {
-				if ((err = flashmng_writeraw(nandtool_common.oid, page, buff, pagesz)) < 0) {
-					fprintf(stderr, "nandtool: failed to write raw data to page %u, err: %d\n", page, err);
-					break;
-				}
+	/* Without a reader thread blocks are read synchronously into the first buffer */
+	if ((mutexCreate(&ring.lock) == EOK) && (condCreate(&ring.cond) == EOK) && ((stack = malloc(FLASH_STACK_SZ)) != NULL)) {
+		if (beginthreadex(nandtool_flashReader, priority(-1), stack, FLASH_STACK_SZ, &ring, &tid) == EOK) {
+			threaded = 1;
+		}
+	}
+
+	err = 0;
+	while (err == 0) {
+		if (threaded) {
+			mutexLock(ring.lock);
+			while (ring.count == 0) {
+				condWait(ring.cond, ring.lock, 0);
 			}
-			else {
-				if (lseek(nandtool_common.fd, (off_t)page * pagesz, SEEK_SET) < 0) {
-					err = -errno;
-					fprintf(stderr, "nandtool: failed to lseek to page %u, err: %d\n", page, err);
-					break;
-				}
+			buf = ring.bufs[ring.head];
+			len = ring.lens[ring.head];
+			pos = ring.pos[ring.head];
+			mutexUnlock(ring.lock);
+		}
+		else {
+			buf = ring.bufs[0];
+			len = nandtool_flashFill(&ring, buf);
+			pos = lseek(ring.fd, 0, SEEK_CUR);
+		}
 
-				if ((err = write(nandtool_common.fd, buff, pagesz)) != pagesz) {
-					err = -errno;
-					fprintf(stderr, "nandtool: failed to write data to page %u, err: %d\n", page, err);
-					break;
-				}
+		if (len <= 0) {
+			if (len < 0) {
+				err = len;
+				fprintf(stderr, "nandtool: failed to read file %s, err: %d\n", path, err);
 			}
+			break;
+		}
+
+		/* Find next good block, bad blocks are skipped */
+		while ((err = flashmng_isbad(nandtool_common.oid, block)) > 0) {
+			block++;
+		}
 
-			offs += boffs;
+		if (err < 0) {
+			fprintf(stderr, "nandtool: failed to check block %u, err: %d\n", block, err);
+			break;
+		}
 
-			perc = (100 * offs) / stat.st_size;
-			if (nandtool_common.interactive) {
-				printf("\rFlashing %s %2u%%...", path, perc);
+		for (i = 0; (i < npages) && (i * pagesz < len); i++) {
+			page = block * npages + i;
+			if (nandtool_isErased(buf + i * pagesz, pagesz)) {
+				skipped++;
+				continue;
 			}
-			else if (perc - oldperc >= 10) {
-				printf("Flashing %s %2u%%\n", path, perc);
-				fflush(stdout);
-				oldperc = perc;
+
+			if ((err = nandtool_flashPage(buf + i * pagesz, page, pagesz, raw)) < 0) {
+				break;
 			}
 		}
 
-		if (err < 0)
+		if (err < 0) {
 			break;
+		}
 
-		printf("\rFlashing %s completed!\n", path);
-		err = 0;
-	} while (0);
+		if (threaded) {
+			mutexLock(ring.lock);
+			ring.head = (ring.head + 1) % FLASH_RING_SZ;
+			ring.count--;
+			condBroadcast(ring.cond);
+			mutexUnlock(ring.lock);
+		}
 
-	free(buff);
-	close(fd);
+		block++;
+
+		perc = (stat.st_size > 0) ? (100ULL * pos) / stat.st_size : 100;
+		if (nandtool_common.interactive) {
+			printf("\rFlashing %s %2u%%...", path, perc);
+		}
+		else if (perc - oldperc >= 10) {
+			printf("Flashing %s %2u%%\n", path, perc);
+			fflush(stdout);
+			oldperc = perc;
+		}
+	}
+
+	if (threaded) {
+		mutexLock(ring.lock);
+		ring.stop = 1;
+		condBroadcast(ring.cond);
+		mutexUnlock(ring.lock);
+		threadJoin(tid, 0);
+	}
+
+	if (err == 0) {
+		printf("\rFlashing %s completed! (%u erased pages skipped)\n", path, skipped);
+	}
+
+	if (ring.cond != 0) {
+		resourceDestroy(ring.cond);
+	}
+	if (ring.lock != 0) {
+		resourceDestroy(ring.lock);
+	}
+	free(stack);
+	for (i = 0; i < FLASH_RING_SZ; i++) {
+		free(ring.bufs[i]);
+	}
+	close(ring.fd);
 
 	return err;
 }
@@ -181,17 +502,124 @@ static int nandtool_check(void)
 }
 
 
-static int nandtool_dump(const char *outpath, unsigned int start, unsigned int nblocks, int oob)
+static int nandtool_writeFull(int fd, const void *buf, size_t size)
+{
+	size_t len = 0;
+	ssize_t err;
+
+	while (len < size) {
+		err = write(fd, (const char *)buf + len, size - len);
+		if (err < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		len += err;
+	}
+
+	return EOK;
+}
+
+
+/* Emits pending erased pages or bad blocks run */
+static int nandtool_sparseFlush(int fd, nandtool_sparserec_t *run, off_t *written)
+{
+	int err;
+
+	if (run->count == 0) {
+		return EOK;
+	}
+
+	if ((err = nandtool_writeFull(fd, run, sizeof(*run))) < 0) {
+		return err;
+	}
+	*written += sizeof(*run);
+	run->count = 0;
+
+	return EOK;
+}
+
+
+/* Stores erase block in sparse format, data pages are grouped into records and erased pages are run-length encoded */
+static int nandtool_sparseBlock(int fd, nandtool_sparserec_t *run, const uint8_t *buf, unsigned int npages, unsigned int pagesz, off_t *written)
+{
+	nandtool_sparserec_t rec;
+	unsigned int i, n;
+	int err;
+
+	for (i = 0; i < npages; i += n) {
+		if (nandtool_isErased((const char *)buf + i * pagesz, pagesz)) {
+			if (run->type != sparse_erased) {
+				if ((err = nandtool_sparseFlush(fd, run, written)) < 0) {
+					return err;
+				}
+				run->type = sparse_erased;
+			}
+			run->count++;
+			n = 1;
+			continue;
+		}
+
+		if ((err = nandtool_sparseFlush(fd, run, written)) < 0) {
+			return err;
+		}
+
+		for (n = 1; (i + n < npages) && !nandtool_isErased((const char *)buf + (i + n) * pagesz, pagesz); n++) {
+		}
+
+		rec.type = sparse_data;
+		rec.count = n;
+		if (((err = nandtool_writeFull(fd, &rec, sizeof(rec))) < 0) || ((err = nandtool_writeFull(fd, buf + i * pagesz, n * pagesz)) < 0)) {
+			return err;
+		}
+		*written += sizeof(rec) + n * pagesz;
+	}
+
+	return EOK;
+}
+
+
+/* Reads npages from the current offset of fd, on a failed block read falls back to page by page reads */
+static ssize_t nandtool_readPages(int fd, off_t addr, void *buf, size_t pagesz, unsigned int npages)
+{
+	unsigned int i;
+	ssize_t len;
+
+	len = read(fd, buf, npages * pagesz);
+	if (len == npages * pagesz) {
+		return len;
+	}
+
+	if (lseek(fd, addr, SEEK_SET) < 0) {
+		return -1;
+	}
+
+	for (i = 0; i < npages; i++) {
+		len = read(fd, (char *)buf + i * pagesz, pagesz);
+		if (len != pagesz) {
+			break;
+		}
+	}
+
+	return ((i > 0) || (len >= 0)) ? (ssize_t)(i * pagesz) : len;
+}
+
+
+static int nandtool_dump(const char *outpath, unsigned int start, unsigned int nblocks, int oob, int sparse)
 {
 	const flashsrv_info_t *info;
+	nandtool_sparserec_t run = { 0 };
+	nandtool_sparsehdr_t hdr;
 	ssize_t len;
 	off_t blocksz, partsz, pagesz;
-	off_t addr, endaddr, bytes;
+	off_t addr, endaddr, bytes, written;
+	unsigned int block;
 	uint8_t *buf;
-	int ret = 0;
+	int ret = 0, err;
 	int outfd;
 
-	outfd = open(outpath, O_WRONLY | O_CREAT);
+	outfd = open(outpath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 	if (outfd < 0) {
 		perror("nandtool_dump: Fail to open output file");
 		return -EINVAL;
@@ -225,7 +653,8 @@ static int nandtool_dump(const char *outpath, unsigned int start, unsigned int n
 		}
 	}
 
-	buf = malloc(pagesz);
+	/* Read whole erase blocks at once */
+	buf = malloc(blocksz);
 	if (buf == NULL) {
 		perror("nandtool_dump: Fail to allocate memory");
 		close(outfd);
@@ -240,29 +669,93 @@ static int nandtool_dump(const char *outpath, unsigned int start, unsigned int n
 		endaddr = addr + nblocks * blocksz;
 	}
 
-	printf("nandtool_dump: %spartition size: %ju, erase block size: %d, write size: %d\n",
-			(oob == 1) ? "raw " : "", (uintmax_t)partsz, info->erasesz, info->writesz);
+	printf("nandtool_dump: %s%spartition size: %ju, erase block size: %d, write size: %d\n",
+			(oob == 1) ? "raw " : "", sparse ? "sparse " : "", (uintmax_t)partsz, info->erasesz, info->writesz);
 
 	printf("nandtool_dump: Reading from address: 0x%jx to 0x%jx\n", (uintmax_t)addr, (uintmax_t)endaddr);
 
 	bytes = 0;
+	written = 0;
+	if (sparse) {
+		hdr.magic = SPARSE_MAGIC;
+		hdr.version = SPARSE_VERSION;
+		hdr.flags = oob ? SPARSE_FLAG_RAW : 0;
+		hdr.pagesz = pagesz;
+		hdr.npages = blocksz / pagesz;
+		hdr.start = start;
+
+		if ((err = nandtool_writeFull(outfd, &hdr, sizeof(hdr))) < 0) {
+			fprintf(stderr, "nandtool_dump: Fail to write to output file at offset: 0, %s\n", strerror(-err));
+			endaddr = addr;
+			ret = -EIO;
+		}
+		else {
+			written += sizeof(hdr);
+		}
+	}
+
 	while (addr + bytes < endaddr) {
+		block = (addr + bytes) / blocksz;
+
+		/* Bad blocks are recorded instead of being read */
+		if (sparse && ((err = flashmng_isbad(nandtool_common.oid, block)) != 0)) {
+			if (err < 0) {
+				fprintf(stderr, "nandtool_dump: Fail to check block %u, err: %d\n", block, err);
+				ret = -EIO;
+				break;
+			}
+
+			if (run.type != sparse_bad) {
+				if (nandtool_sparseFlush(outfd, &run, &written) < 0) {
+					fprintf(stderr, "nandtool_dump: Fail to write to output file at offset: %jx, %s\n", (uintmax_t)written, strerror(errno));
+					ret = -EIO;
+					break;
+				}
+				run.type = sparse_bad;
+			}
+			run.count++;
+			bytes += blocksz;
+
+			if (!oob && (lseek(nandtool_common.fd, addr + bytes, SEEK_SET) < 0)) {
+				perror("nandtool_dump: lseek failed");
+				ret = -EIO;
+				break;
+			}
+			continue;
+		}
+
 		if (oob) {
-			len = flashmng_readraw(nandtool_common.oid, addr + bytes, buf, pagesz);
+			len = flashmng_readrawpages(nandtool_common.oid, addr + bytes, buf, pagesz, blocksz / pagesz);
+			if (len > 0) {
+				len *= pagesz;
+			}
 		}
 		else {
-			len = read(nandtool_common.fd, buf, pagesz);
+			len = nandtool_readPages(nandtool_common.fd, addr + bytes, buf, pagesz, blocksz / pagesz);
 		}
 
-		if (len != pagesz) {
-			fprintf(stderr, "nandtool_dump: Fail to read a block at offset: %jx, %s\n", (uintmax_t)(addr + bytes), strerror(errno));
-			ret = -EIO;
-			break;
+		/* Store pages read before a failure */
+		if (len > 0) {
+			if (sparse) {
+				err = nandtool_sparseBlock(outfd, &run, buf, len / pagesz, pagesz, &written);
+			}
+			else {
+				err = nandtool_writeFull(outfd, buf, len);
+				written += len;
+			}
+
+			if (err < 0) {
+				fprintf(stderr, "nandtool_dump: Fail to write to output file at offset: %jx, %s\n", (uintmax_t)written, strerror(-err));
+				ret = -EIO;
+				break;
+			}
 		}
 
-		len = write(outfd, buf, pagesz);
-		if (len != pagesz) {
-			fprintf(stderr, "nandtool_dump: Fail to write to output file at offset: %jx, %s\n", (uintmax_t)bytes, strerror(errno));
+		if (len != blocksz) {
+			if (len > 0) {
+				bytes += len;
+			}
+			fprintf(stderr, "nandtool_dump: Fail to read a block at offset: %jx, %s\n", (uintmax_t)(addr + bytes), strerror(errno));
 			ret = -EIO;
 			break;
 		}
@@ -270,7 +763,25 @@ static int nandtool_dump(const char *outpath, unsigned int start, unsigned int n
 		bytes += len;
 	}
 
-	printf("nandtool_dump: Written %jd bytes to %s file\n", (intmax_t)bytes, outpath);
+	if (nandtool_sparseFlush(outfd, &run, &written) < 0) {
+		fprintf(stderr, "nandtool_dump: Fail to write to output file at offset: %jx, %s\n", (uintmax_t)written, strerror(errno));
+		ret = -EIO;
+	}
+
+	/* Only a complete dump is terminated, flashing rejects the image otherwise */
+	if (sparse && (ret == 0)) {
+		run.type = sparse_end;
+		run.count = bytes / blocksz;
+		if ((err = nandtool_writeFull(outfd, &run, sizeof(run))) < 0) {
+			fprintf(stderr, "nandtool_dump: Fail to write to output file at offset: %jx, %s\n", (uintmax_t)written, strerror(-err));
+			ret = -EIO;
+		}
+		else {
+			written += sizeof(run);
+		}
+	}
+
+	printf("nandtool_dump: Dumped %jd bytes, written %jd bytes to %s file\n", (intmax_t)bytes, (intmax_t)written, outpath);
 
 	close(outfd);
 	free(buf);
@@ -327,6 +838,7 @@ static int nandtool_scan(const char *dev, dbbt_t *dbbt)
 	for (idx = 0; idx < info->size / info->erasesz; idx++) {
 		unsigned int blockno = (offs / info->erasesz) + idx;
 
+		/* Blocks of the device already checked while flashing it in this run are served from flashmng cache */
 		if (flashmng_isbad(oid, idx)) {
 			printf("nandtool: block %u is marked as bad\n", blockno);
 			if (dbbt != NULL) {
@@ -427,6 +939,8 @@ static void nandtool_help(const char *prog)
 	printf("\t                    (skip size to dump one block or pass size=0 to dump everything until the end of a partition)\n");
 	printf("\t-o <path>         - path of the file to dump data\n");
 	printf("\t-b                - dump out-of-bound data (raw reads)\n");
+	printf("\t-z                - sparse dump: run-length encode erased pages and bad blocks\n");
+	printf("\t                    (flashing with -i detects sparse images, use -r for sparse dumps made with -b)\n");
 	printf("\n");
 	printf("\t-i <path>         - path of the file to flash (requires -s option)\n");
 	printf("\t-r                - flash raw data\n");
@@ -469,7 +983,7 @@ static int nandtool_parseRange(const char *str, int *start, int *size)
 int main(int argc, char **argv)
 {
 	int check = 0, raw = 0, flash_start = -1, erase_start = -1, erase_size = -1, write_cleanmarkers = 0;
-	int dump_start = -1, dump_size = -1, oob = 0;
+	int dump_start = -1, dump_size = -1, oob = 0, sparse = 0;
 #ifdef HAS_BCB
 	int write_fcb = 0;
 	int write_dbbt = 0;
@@ -484,7 +998,7 @@ int main(int argc, char **argv)
 	if (isatty(STDOUT_FILENO))
 		nandtool_common.interactive = 1;
 
-	while ((c = getopt(argc, argv, "e:d:i:o:rs:bchjqftl:")) != -1) {
+	while ((c = getopt(argc, argv, "e:d:i:o:rs:bzchjqftl:")) != -1) {
 		switch (c) {
 			case 'e':
 				if (nandtool_parseRange(optarg, &erase_start, &erase_size) < 0) {
@@ -534,6 +1048,10 @@ int main(int argc, char **argv)
 				oob = 1;
 				break;
 
+			case 'z':
+				sparse = 1;
+				break;
+
 			case 'r':
 				raw = 1;
 				break;
@@ -637,7 +1155,7 @@ int main(int argc, char **argv)
 	} while (0);
 
 	if ((dump_start >= 0) && (opath != NULL)) {
-		nandtool_dump(opath, dump_start, dump_size, oob);
+		nandtool_dump(opath, dump_start, dump_size, oob, sparse);
 	}
 
 	close(nandtool_common.fd);
@@ -13,8 +13,10 @@
 
 #include "sdp.h"
 
+#include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/minmax.h>
 
 #define CONTROL_ENDPOINT 0
 #define INTERRUPT_ENPOINT 1
@@ -66,6 +68,78 @@ int sdp_recv(int report, char *data, unsigned int len, char **outdata)
 }
 
 
+int sdp_recvv(const sdp_iov_t *iov, unsigned int iovcnt, int final)
+{
+	static char report[SDP_DATA_SIZE + 1];
+	unsigned int i = 0, offs = 0, len, n;
+	int res, total = 0;
+	char *data, id, save;
+
+	while (i < iovcnt) {
+		if (offs == iov[i].len) {
+			i++;
+			offs = 0;
+			continue;
+		}
+		data = iov[i].data + offs;
+
+		/* Report fits, receive it in place with report ID stored in the preceding byte */
+		if (iov[i].len - offs >= SDP_DATA_SIZE) {
+			save = data[-1];
+			res = hid_recv(CONTROL_ENDPOINT, data - 1, SDP_DATA_SIZE + 1);
+			id = data[-1];
+			data[-1] = save;
+
+			if (res < 0)
+				return -1;
+
+			if ((res < 1) || (id != 2))	/* HID report SDP CMD DATA */
+				return -2;
+
+			offs += res - 1;
+			total += res - 1;
+			continue;
+		}
+
+		/* Buffer tail, scatter report data */
+		if ((res = hid_recv(CONTROL_ENDPOINT, report, sizeof(report))) < 0)
+			return -1;
+
+		if ((res < 1) || (report[0] != 2))
+			return -2;
+
+		for (len = 1; len < res; len += n) {
+			if (i >= iovcnt) {
+				/* Last report exceeds requested data, excess is padding only at the end of transfer */
+				if (!final)
+					return -3;
+				break;
+			}
+
+			n = min(res - len, iov[i].len - offs);
+			memcpy(iov[i].data + offs, report + len, n);
+			offs += n;
+			total += n;
+
+			if (offs == iov[i].len) {
+				i++;
+				offs = 0;
+			}
+		}
+	}
+
+	return total;
+}
+
+
+int sdp_recvData(char *data, unsigned int len, int final)
+{
+	sdp_iov_t iov = { .data = data, .len = len };
+
+	return sdp_recvv(&iov, 1, final);
+}
+
+
 void sdp_destroy(void)
 {
 	hid_destroy();
@@ -37,6 +37,13 @@
 #define CLOSE_PSD               -100
 
 
+/* Max data size of SDP CMD DATA report */
+#define SDP_DATA_SIZE 1024
+
+/* Space reserved before every buffer passed to sdp_recvv(), last byte is temporarily used for report ID */
+#define SDP_HEADROOM 4
+
+
 enum {
 	SDP_READ_REGISTER = 0x0101,
 	SDP_WRITE_REGISTER = 0x0202,
@@ -58,6 +65,12 @@ typedef struct _sdp_cmd_t {
 } __attribute__((packed)) sdp_cmd_t;
 
 
+typedef struct _sdp_iov_t {
+	char *data;
+	unsigned int len;
+} sdp_iov_t;
+
+
 int sdp_init(const usb_hid_dev_setup_t* dev_setup);
 
 
@@ -67,6 +80,17 @@ int sdp_send(int report, const char *data, unsigned int len);
 int sdp_recv(int report, char *data, unsigned int len, char **outdata);
 
 
+/*
+ * Receives SDP CMD DATA reports until all buffers are filled, returns number of bytes stored.
+ * Each iov entry must be preceded by SDP_HEADROOM writable bytes. Data of the last report past
+ * the last buffer is dropped only if final is set (last chunk of transfer), otherwise -3 is returned.
+ */
+int sdp_recvv(const sdp_iov_t *iov, unsigned int iovcnt, int final);
+
+
+int sdp_recvData(char *data, unsigned int len, int final);
+
+
 void sdp_destroy(void);
 
 
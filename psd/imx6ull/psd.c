@@ -26,6 +26,7 @@
 #include <sys/stat.h>
 #include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/minmax.h>
 #include <sys/reboot.h>
 #include <sys/platform.h>
 
@@ -42,6 +43,13 @@
 
 #define FILES_SIZE 16
 
+#define RING_SIZE 8 /* Number of page buffers between USB receive and flash write */
+
+/* SDP_WRITE_FILE formats */
+#define WRITE_DIRECT      1 /* Abort on bad block */
+#define WRITE_ERASE       2 /* Erase blocks ahead of writes, raw target */
+#define WRITE_ERASE_JFFS2 8 /* Erase blocks ahead of writes and write JFFS2 cleanmarkers back */
+
 #define HID_REPORT_1_SIZE (sizeof(sdp_cmd_t) + 1)
 #define HID_REPORT_2_SIZE 1025
 #define HID_REPORT_3_SIZE 5
@@ -76,13 +84,43 @@ struct filedes {
 };
 
 
+/* Erase-ahead block states */
+enum { block_good = 0, block_bad, block_failed };
+
+
+/* Ring of received pages, filled by USB receive and flushed by flash writer thread */
+typedef struct {
+	char *buffs; /* Page buffers, each preceded by SDP_HEADROOM bytes */
+	int len[RING_SIZE];
+	unsigned int head;
+	unsigned int count;
+	int done; /* All pages received */
+	int stop; /* Writer stopped */
+	int err;  /* Writer error */
+
+	off_t fileOffs;  /* Write offset, owned by writer */
+	off_t startOffs; /* Write start offset, constant after setup */
+	uint8_t format;
+	uint32_t datasz;
+
+	/* Erase-ahead, blocks are classified and erased if requested in write order */
+	off_t blockOffs;         /* Offset of first block */
+	uint8_t *blocks;         /* States of prepared blocks */
+	unsigned int nblocks;    /* Number of prepared blocks */
+	unsigned int maxblocks;  /* Number of blocks to the end of partition */
+	int aheadDone;           /* Erase-ahead finished */
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} psd_ring_t;
+
+
 struct {
 	int run;
 
 	dbbt_t* dbbt;
 	flashsrv_info_t flash;
 
-	char rcvBuff[HID_REPORT_2_SIZE];
 	char buff[_PAGE_SIZE * 2]; /* assuming always big enough to fit psd_common.flash.writesz */
 
 	off_t partsz;
@@ -362,11 +400,172 @@ static int psd_writeRegister(sdp_cmd_t *cmd)
 }
 
 
+static inline char *psd_ringBuff(psd_ring_t *ring, unsigned int idx)
+{
+	return ring->buffs + idx * (SDP_HEADROOM + psd_common.flash.writesz) + SDP_HEADROOM;
+}
+
+
+static void *psd_eraseAheadThread(void *arg)
+{
+	psd_ring_t *ring = arg;
+	off_t offs = ring->blockOffs, left;
+	uint8_t state;
+	int stop;
+
+	/* Data to place starting from the first block */
+	left = ring->datasz + (ring->startOffs - ring->blockOffs);
+
+	do {
+		state = (flashmng_isBadBlock(psd_common.f->oid, offs) != 0) ? block_bad : block_good;
+
+		/* Only blocks fully covered by the file are erased, other part of a partially covered block may hold data */
+		if ((state == block_good) && ((ring->format == WRITE_ERASE) || (ring->format == WRITE_ERASE_JFFS2)) &&
+				(offs >= ring->startOffs) && (left >= psd_common.flash.erasesz)) {
+			if (flashmng_eraseBlocks(psd_common.f->oid, offs, psd_common.flash.erasesz) < 0) {
+				state = block_failed;
+			}
+			else if ((ring->format == WRITE_ERASE_JFFS2) && (flashmng_cleanMarkers(psd_common.f->oid, offs, psd_common.flash.erasesz) < 0)) {
+				state = block_failed;
+			}
+		}
+
+		if (state == block_good) {
+			left -= psd_common.flash.erasesz;
+		}
+
+		pthread_mutex_lock(&ring->lock);
+		ring->blocks[ring->nblocks++] = state;
+		pthread_cond_broadcast(&ring->cond);
+		stop = ring->stop || (state == block_failed) || ((state == block_bad) && (ring->format == WRITE_DIRECT));
+		pthread_mutex_unlock(&ring->lock);
+
+		offs += psd_common.flash.erasesz;
+	} while (!stop && (left > 0) && (ring->nblocks < ring->maxblocks));
+
+	pthread_mutex_lock(&ring->lock);
+	ring->aheadDone = 1;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+
+	return NULL;
+}
+
+
+/* Returns prepared block state, -1 if it failed to erase, falls back to device query past the prepared area */
+static int psd_isBadBlock(psd_ring_t *ring, off_t offs)
+{
+	unsigned int idx = (offs - ring->blockOffs) / psd_common.flash.erasesz;
+	int state;
+
+	pthread_mutex_lock(&ring->lock);
+	while ((idx >= ring->nblocks) && !ring->aheadDone) {
+		pthread_cond_wait(&ring->cond, &ring->lock);
+	}
+	state = (idx < ring->nblocks) ? ring->blocks[idx] : -1;
+	pthread_mutex_unlock(&ring->lock);
+
+	if (state < 0) {
+		return flashmng_isBadBlock(psd_common.f->oid, offs);
+	}
+
+	if (state == block_failed) {
+		return -1;
+	}
+
+	return (state == block_bad) ? 1 : 0;
+}
+
+
+/* Writes received page, returns 1 on bad block in direct write mode */
+static int psd_writePage(psd_ring_t *ring, const char *buff, int len)
+{
+	int bad;
+
+	/* check for badblocks - TODO: test it */
+	if (ring->fileOffs % psd_common.flash.erasesz == 0) {
+		while ((bad = psd_isBadBlock(ring, ring->fileOffs)) != 0) {
+			if (bad < 0) {
+				printf("writeFile: failed to erase block at offs: 0x%x\n", (uint32_t)ring->fileOffs);
+				return -eReport2;
+			}
+
+			printf("writeFile: badblock at offs: 0x%x\n", (uint32_t)ring->fileOffs);
+
+			/* Direct write - abort without error */
+			if (ring->format == WRITE_DIRECT) {
+				return 1;
+			}
+
+			/* badblock - skip it */
+			if (lseek(psd_common.f->fd, psd_common.flash.erasesz, SEEK_CUR) < 0) {
+				return -eReport2;
+			}
+
+			ring->fileOffs += psd_common.flash.erasesz;
+		}
+	}
+
+	if (write(psd_common.f->fd, buff, psd_common.flash.writesz) != psd_common.flash.writesz) {
+		return -eReport2;
+	}
+
+	ring->fileOffs += len;
+
+	return hidOK;
+}
+
+
+static void *psd_writerThread(void *arg)
+{
+	psd_ring_t *ring = arg;
+	char *buff;
+	int err, len;
+
+	pthread_mutex_lock(&ring->lock);
+	for (;;) {
+		while ((ring->count == 0) && !ring->done) {
+			pthread_cond_wait(&ring->cond, &ring->lock);
+		}
+
+		if (ring->count == 0) {
+			break;
+		}
+
+		buff = psd_ringBuff(ring, ring->head);
+		len = ring->len[ring->head];
+		pthread_mutex_unlock(&ring->lock);
+
+		err = psd_writePage(ring, buff, len);
+
+		pthread_mutex_lock(&ring->lock);
+		ring->head = (ring->head + 1) % RING_SIZE;
+		ring->count--;
+
+		if (err != hidOK) {
+			ring->err = (err < 0) ? err : hidOK;
+			ring->stop = 1;
+		}
+		pthread_cond_broadcast(&ring->cond);
+
+		if (ring->stop) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ring->lock);
+
+	return NULL;
+}
+
+
 static int psd_writeFile(sdp_cmd_t *cmd)
 {
-	int res, err = hidOK, buffOffset = 0, badBlock = 0;
+	int res, err = hidOK, buffOffset = 0;
 	off_t writesz, fileOffs = cmd->address;
-	char *outdata = NULL;
+	char *buff;
+	unsigned int idx;
+	psd_ring_t ring;
+	pthread_t writer, eraser;
 
 	/* Check command parameters */
 	if (fileOffs % psd_common.flash.writesz != 0) {
@@ -381,63 +580,116 @@ static int psd_writeFile(sdp_cmd_t *cmd)
 		return -eReport1;
 	}
 
-	printf("PSD: Writing file.\n");
-
-	/* Receive and write file */
-	for (writesz = 0; !err && (writesz < cmd->datasz); writesz += buffOffset) {
+	memset(&ring, 0, sizeof(ring));
+	ring.fileOffs = fileOffs;
+	ring.startOffs = fileOffs;
+	ring.format = cmd->format;
+	ring.datasz = cmd->datasz;
+	ring.blockOffs = fileOffs - fileOffs % psd_common.flash.erasesz;
+	ring.maxblocks = (psd_common.partsz - ring.blockOffs + psd_common.flash.erasesz - 1) / psd_common.flash.erasesz;
 
-		memset(psd_common.buff, 0xff, psd_common.flash.writesz);
-		buffOffset = 0;
+	if ((ring.buffs = malloc(RING_SIZE * (SDP_HEADROOM + psd_common.flash.writesz))) == NULL) {
+		return -eReport1;
+	}
 
-		while ((buffOffset < psd_common.flash.writesz) && (writesz + buffOffset < cmd->datasz)) {
-			if ((res = sdp_recv(1, psd_common.rcvBuff, HID_REPORT_2_SIZE, &outdata)) < 0 ) {
-				err = -eReport2;
-				break;
-			}
-			memcpy(psd_common.buff + buffOffset, outdata, res);
-			buffOffset += res;
-		}
+	if ((ring.blocks = malloc(ring.maxblocks + 1)) == NULL) {
+		free(ring.buffs);
+		return -eReport1;
+	}
 
-		if (buffOffset && !err) {
+	pthread_mutex_init(&ring.lock, NULL);
+	pthread_cond_init(&ring.cond, NULL);
 
-			/* check for badblocks - TODO: test it */
-			if (fileOffs % psd_common.flash.erasesz == 0) {
-				while (flashmng_isBadBlock(psd_common.f->oid, fileOffs)) {
-					printf("writeFile: badblock at offs: 0x%x\n", (uint32_t)fileOffs);
+	/* Erase-ahead is required to erase blocks, otherwise bad blocks are checked by the writer */
+	if ((cmd->datasz == 0) || (pthread_create(&eraser, NULL, psd_eraseAheadThread, &ring) != 0)) {
+		if ((cmd->datasz != 0) && ((ring.format == WRITE_ERASE) || (ring.format == WRITE_ERASE_JFFS2))) {
+			pthread_cond_destroy(&ring.cond);
+			pthread_mutex_destroy(&ring.lock);
+			free(ring.blocks);
+			free(ring.buffs);
+			return -eReport1;
+		}
+		ring.aheadDone = 1;
+		ring.maxblocks = 0;
+	}
 
-					/* Direct write - abort without error */
-					if (cmd->format == 1) {
-						badBlock = 1;
-						break;
-					}
+	if (pthread_create(&writer, NULL, psd_writerThread, &ring) != 0) {
+		pthread_mutex_lock(&ring.lock);
+		ring.stop = 1;
+		pthread_mutex_unlock(&ring.lock);
+		if (ring.maxblocks != 0) {
+			pthread_join(eraser, NULL);
+		}
+		pthread_cond_destroy(&ring.cond);
+		pthread_mutex_destroy(&ring.lock);
+		free(ring.blocks);
+		free(ring.buffs);
+		return -eReport1;
+	}
 
-					/* badblock - skip it */
-					if (lseek(psd_common.f->fd, psd_common.flash.erasesz, SEEK_CUR) < 0) {
-						err = -eReport2;
-						break;
-					}
+	printf("PSD: Writing file.\n");
 
-					fileOffs += psd_common.flash.erasesz;
-				}
-			}
+	/* Receive file, pages are written by the writer thread */
+	for (writesz = 0; writesz < cmd->datasz; writesz += buffOffset) {
+		pthread_mutex_lock(&ring.lock);
+		while ((ring.count == RING_SIZE) && !ring.stop) {
+			pthread_cond_wait(&ring.cond, &ring.lock);
+		}
+		idx = (ring.head + ring.count) % RING_SIZE;
+		res = ring.stop;
+		pthread_mutex_unlock(&ring.lock);
 
-			/* Direct write - abort due to bad block */
-			if (badBlock == 1) {
-				break;
-			}
+		/* Writer failed or direct write aborted due to bad block */
+		if (res) {
+			break;
+		}
 
-			if (!err && ((res = write(psd_common.f->fd, psd_common.buff, psd_common.flash.writesz)) != psd_common.flash.writesz)) {
-				err = -eReport2;
-				break;
-			}
+		buff = psd_ringBuff(&ring, idx);
+		buffOffset = min(psd_common.flash.writesz, cmd->datasz - writesz);
 
-			fileOffs += buffOffset;
+		/* Reports are received directly into the page buffer */
+		if (buffOffset < psd_common.flash.writesz) {
+			memset(buff + buffOffset, 0xff, psd_common.flash.writesz - buffOffset);
 		}
-		else {
+
+		if (sdp_recvData(buff, buffOffset, (writesz + buffOffset) >= cmd->datasz) != buffOffset) {
 			err = -eReport2;
+			break;
 		}
+
+		pthread_mutex_lock(&ring.lock);
+		ring.len[idx] = buffOffset;
+		ring.count++;
+		pthread_cond_broadcast(&ring.cond);
+		pthread_mutex_unlock(&ring.lock);
 	}
 
+	/* Flush remaining pages */
+	pthread_mutex_lock(&ring.lock);
+	ring.done = 1;
+	pthread_cond_broadcast(&ring.cond);
+	pthread_mutex_unlock(&ring.lock);
+
+	pthread_join(writer, NULL);
+
+	/* Stop erase-ahead, remaining blocks are not needed */
+	pthread_mutex_lock(&ring.lock);
+	ring.stop = 1;
+	pthread_mutex_unlock(&ring.lock);
+
+	if (ring.maxblocks != 0) {
+		pthread_join(eraser, NULL);
+	}
+
+	if (err == hidOK) {
+		err = ring.err;
+	}
+
+	pthread_cond_destroy(&ring.cond);
+	pthread_mutex_destroy(&ring.lock);
+	free(ring.blocks);
+	free(ring.buffs);
+
 	return psd_hidResponse(err, SDP_WRITE_FILE);
 }
 
@@ -21,6 +21,7 @@
 #include <sys/stat.h>
 #include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/minmax.h>
 #include <sys/types.h>
 #include <sys/platform.h>
 #include <sys/reboot.h>
@@ -35,6 +36,8 @@
 #define HID_REPORT_3_SIZE 5
 #define HID_REPORT_4_SIZE 65
 
+#define WRITE_BUFF_SIZE (4 * SDP_DATA_SIZE) /* Data reports coalesced into single flash write */
+
 #define FLASH_CNT 2
 
 #define INTERNAL_FLASH_NAME "/dev/flash1"
@@ -60,6 +63,7 @@ struct {
 	int run;
 	uint8_t flashID;
 	char buff[HID_REPORT_2_SIZE];
+	char data[SDP_HEADROOM + WRITE_BUFF_SIZE];
 } psd_common;
 
 
@@ -262,9 +266,9 @@ int psd_writeRegister(sdp_cmd_t *cmd)
 
 int psd_writeFile(sdp_cmd_t *cmd)
 {
-	int res, err = hidOK, offset = 0;
+	int res, len, err = hidOK, offset = 0;
 	off_t writesz;
-	char *outdata = NULL;
+	char *data = psd_common.data + SDP_HEADROOM;
 
 	flash_properties_t *flash = (flash_properties_t *)&psd_common.flashMems[psd_common.flashID];
 
@@ -273,16 +277,19 @@ int psd_writeFile(sdp_cmd_t *cmd)
 	/* Receive and write file */
 	for (writesz = 0; !err && (writesz < cmd->datasz);) {
 
-		memset(psd_common.buff, 0xff, HID_REPORT_2_SIZE - 1);
-		if ((res = sdp_recv(1, psd_common.buff, HID_REPORT_2_SIZE, &outdata)) < 0 ) {
+		res = min(WRITE_BUFF_SIZE, cmd->datasz - writesz);
+		if (sdp_recvData(data, res, (writesz + res) >= cmd->datasz) != res) {
 			err = -eReport2;
 			break;
 		}
 
-		if (res % flash->pageSize )
-			res = (res / flash->pageSize + 1) * flash->pageSize;
+		if (res % flash->pageSize) {
+			len = (res / flash->pageSize + 1) * flash->pageSize;
+			memset(data + res, 0xff, len - res);
+			res = len;
+		}
 
-		if (psd_write2Flash(flash->oid, offset, outdata, res) < res) {
+		if (psd_write2Flash(flash->oid, offset, data, res) < res) {
 			err = -eReport2;
 			break;
 		}
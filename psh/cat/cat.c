@@ -12,15 +12,27 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include "../psh.h"
 
-#define SIZE_BUFF 1024
+#define SIZE_BUFF_MIN 1024        /* Minimal copy buffer size */
+#define SIZE_BUFF_MAX (64 * 1024) /* Maximal copy buffer size */
+#define SIZE_MMAP     (16 * _PAGE_SIZE)
+
+
+typedef struct {
+	char *buff;
+	size_t buffsz;
+	unsigned char nommap; /* Set when file mapping is not supported */
+} psh_cat_ctx_t;
+
 
 void psh_catinfo(void)
 {
@@ -40,12 +52,85 @@ static inline int psh_cat_isExit(void)
 }
 
 
-int psh_cat(int argc, char **argv)
+/* Writes regular file to stdout through mapped windows, returns -ENOTSUP if file can't be mapped */
+static int psh_cat_mmap(psh_cat_ctx_t *ctx, int fd, off_t size)
+{
+	off_t offs = 0;
+	size_t len;
+	void *data;
+
+	while ((offs < size) && (psh_cat_isExit() == 0)) {
+		len = ((size - offs) > SIZE_MMAP) ? SIZE_MMAP : (size_t)(size - offs);
+
+		data = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, offs);
+		if (data == MAP_FAILED) {
+			if (offs == 0) {
+				ctx->nommap = 1;
+				return -ENOTSUP;
+			}
+			return -errno;
+		}
+
+		if (psh_write(STDOUT_FILENO, data, len) != len) {
+			(void)munmap(data, len);
+			return -errno;
+		}
+
+		(void)munmap(data, len);
+		offs += len;
+	}
+
+	return 0;
+}
+
+
+static int psh_cat_stream(psh_cat_ctx_t *ctx, int fd, const struct stat *st)
 {
-	FILE *file;
+	size_t buffsz = SIZE_BUFF_MIN;
+	ssize_t len;
 	char *buff;
-	size_t ret, len, wrote;
-	int c, i, retval = EXIT_SUCCESS;
+
+	/* Match buffer to the source preferred I/O size */
+	while ((buffsz < (size_t)st->st_blksize) && (buffsz < SIZE_BUFF_MAX)) {
+		buffsz <<= 1;
+	}
+
+	if (buffsz > ctx->buffsz) {
+		buff = realloc(ctx->buff, buffsz);
+		if (buff != NULL) {
+			ctx->buff = buff;
+			ctx->buffsz = buffsz;
+		}
+		else if (ctx->buff == NULL) {
+			return -ENOMEM;
+		}
+	}
+
+	while (psh_cat_isExit() == 0) {
+		len = read(fd, ctx->buff, ctx->buffsz);
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		else if (len == 0) {
+			break;
+		}
+
+		if (psh_write(STDOUT_FILENO, ctx->buff, len) != (size_t)len) {
+			return -errno;
+		}
+	}
+
+	return 0;
+}
+
+
+int psh_cat(int argc, char **argv)
+{
+	psh_cat_ctx_t ctx = { NULL, 0, 0 };
+	int c, i, fd, err, retval = EXIT_SUCCESS;
 	struct stat sbuff;
 
 	for (;;) {
@@ -64,57 +149,47 @@ int psh_cat(int argc, char **argv)
 		}
 	}
 
-	/* FIXME? We're operating on streams, there should be no need for big buffers */
-	buff = malloc(SIZE_BUFF);
-	if (buff == NULL) {
-		perror("cat");
-		return EXIT_FAILURE;
-	}
+	/* Data is written directly to the stdout fd */
+	fflush(stdout);
 
 	for (i = optind; (psh_cat_isExit() == 0) && (i < argc); ++i) {
-		if (stat(argv[i], &sbuff) < 0) {
+		fd = open(argv[i], O_RDONLY);
+		if (fd < 0) {
+			fprintf(stderr, "cat: %s: %s\n", argv[i], strerror(errno));
+			retval = EXIT_FAILURE;
+			continue;
+		}
+
+		if (fstat(fd, &sbuff) < 0) {
 			fprintf(stderr, "cat: %s: %s\n", argv[i], strerror(errno));
 			retval = EXIT_FAILURE;
+			close(fd);
 			continue;
 		}
 		else if (S_ISDIR(sbuff.st_mode)) {
 			fprintf(stderr, "cat: %s: %s\n", argv[i], strerror(EISDIR));
 			retval = EXIT_FAILURE;
+			close(fd);
 			continue;
 		}
-		else {
-			file = fopen(argv[i], "r");
-			if (file == NULL) {
-				fprintf(stderr, "cat: %s: %s\n", argv[i], strerror(errno));
-				retval = EXIT_FAILURE;
-				continue;
-			}
 
-			while (psh_cat_isExit() == 0) {
-				len = fread(buff, 1, SIZE_BUFF, file);
-				if (len > 0) {
-					wrote = 0;
-					do {
-						ret = fwrite(buff + wrote, 1, len, stdout);
-						if (ret == 0) {
-							retval = EXIT_FAILURE;
-							break;
-						}
-						len -= ret;
-						wrote += ret;
-					} while (len > 0);
-				}
-				else {
-					if (ferror(file) != 0) {
-						retval = EXIT_FAILURE;
-					}
-					break;
-				}
-			}
-			fclose(file);
+		err = -ENOTSUP;
+		if ((ctx.nommap == 0) && S_ISREG(sbuff.st_mode) && (sbuff.st_size > SIZE_BUFF_MAX)) {
+			err = psh_cat_mmap(&ctx, fd, sbuff.st_size);
 		}
+
+		if (err == -ENOTSUP) {
+			err = psh_cat_stream(&ctx, fd, &sbuff);
+		}
+
+		if (err < 0) {
+			fprintf(stderr, "cat: %s: %s\n", argv[i], strerror(-err));
+			retval = EXIT_FAILURE;
+		}
+
+		close(fd);
 	}
-	free(buff);
+	free(ctx.buff);
 
 	return retval;
 }
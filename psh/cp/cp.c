@@ -16,6 +16,9 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <libgen.h>
@@ -23,7 +26,15 @@
 
 #include "../psh.h"
 
-#define SIZE_BUFF 256
+#define SIZE_BUFF  (64 * 1024) /* Copy buffer size, buffer is page aligned */
+#define SIZE_CHUNK 512         /* Default hole detection granularity */
+
+
+static struct {
+	unsigned char *buff;
+	int preserve;
+	int recursive;
+} psh_cp_common;
 
 
 static void psh_cpinfo(void)
@@ -36,175 +47,378 @@ static void psh_cp_help(const char *prog)
 {
 	printf("Usage: %s [options] SOURCE TARGET\n", prog);
 	printf("  -p:  preserve file attributes\n");
+	printf("  -r:  copy directories recursively\n");
 	printf("  -h:  shows this help message\n");
 }
 
 
-static int psh_cp(int argc, char **argv)
+static int psh_cp_iszero(const unsigned char *buff, size_t len)
+{
+	const unsigned long *word = (const unsigned long *)buff;
+	size_t i;
+
+	/* buff is aligned, len is a multiple of the chunk size */
+	for (i = 0; i < len / sizeof(*word); i++) {
+		if (word[i] != 0) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+
+static char *psh_cp_joinpath(const char *dir, const char *name)
+{
+	size_t dirlen = strlen(dir), namelen = strlen(name);
+	char *path = malloc(dirlen + namelen + 2);
+
+	if (path == NULL) {
+		fprintf(stderr, "cp: out of memory\n");
+		return NULL;
+	}
+
+	memcpy(path, dir, dirlen);
+	if ((dirlen == 0) || (dir[dirlen - 1] != '/')) {
+		path[dirlen++] = '/';
+	}
+	memcpy(path + dirlen, name, namelen + 1);
+
+	return path;
+}
+
+
+static int psh_cp_attrs(const char *path, const struct stat *stat)
 {
-	FILE *src = NULL, *dst = NULL;
-	int fdsrc, fddst;
-	unsigned char buff[SIZE_BUFF];
-	char *filename, *destpath = NULL, *attrpath;
-	size_t destlen, filelen, cnt, wcnt;
-	struct stat stat;
-	int c, retval = EXIT_SUCCESS, preserve = 0;
 	struct timeval times[2];
+	int retval = EXIT_SUCCESS;
 
-	while ((c = getopt(argc, argv, "hp")) != -1) {
-		switch (c) {
-			case 'h':
-				psh_cp_help(argv[0]);
-				return EXIT_SUCCESS;
-			case 'p':
-				preserve = 1;
-				break;
-			default:
-				psh_cp_help(argv[0]);
-				return EXIT_FAILURE;
+	times[0].tv_sec = stat->st_atim.tv_sec;
+	times[1].tv_sec = stat->st_mtim.tv_sec;
+	times[0].tv_usec = 0;
+	times[1].tv_usec = 0;
+
+	if (chown(path, stat->st_uid, stat->st_gid) < 0) {
+		retval = EXIT_FAILURE;
+		perror("cp: destination chown failed");
+	}
+
+	if (chmod(path, stat->st_mode) < 0) {
+		retval = EXIT_FAILURE;
+		perror("cp: destination chmod failed");
+	}
+
+	if (utimes(path, times) < 0) {
+		retval = EXIT_FAILURE;
+		perror("cp: destination utimes failed");
+	}
+
+	return retval;
+}
+
+
+/* Writes len bytes of buff, all-zero chunks of regular destination are skipped leaving a hole */
+static int psh_cp_writeout(int fd, const unsigned char *buff, size_t len, size_t chunk, int sparse, int *holes)
+{
+	size_t offs, wlen = 0;
+
+	for (offs = 0; offs < len; offs += chunk) {
+		if ((sparse == 0) || ((len - offs) < chunk) || (psh_cp_iszero(buff + offs, chunk) == 0)) {
+			wlen += ((len - offs) < chunk) ? (len - offs) : chunk;
+			continue;
+		}
+
+		if ((wlen != 0) && (psh_write(fd, buff + offs - wlen, wlen) != wlen)) {
+			return -1;
 		}
+		wlen = 0;
+
+		if (lseek(fd, chunk, SEEK_CUR) < 0) {
+			return -1;
+		}
+		*holes = 1;
 	}
 
-	if (argc - optind != 2) {
-		psh_cp_help(argv[0]);
+	if ((wlen != 0) && (psh_write(fd, buff + len - wlen, wlen) != wlen)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static int psh_cp_file(const char *srcpath, const char *dstpath, const struct stat *srcstat)
+{
+	int fdsrc, fddst, holes = 0, sparse, retval = EXIT_SUCCESS;
+	size_t chunk, buffsz, cnt;
+	ssize_t rcnt = 0;
+	off_t total = 0;
+	struct stat dststat;
+
+	/* Destination is truncated on open, refuse to copy a file onto itself */
+	if ((stat(dstpath, &dststat) == 0) && (dststat.st_dev == srcstat->st_dev) && (dststat.st_ino == srcstat->st_ino)) {
+		fprintf(stderr, "cp: %s and %s are the same file\n", srcpath, dstpath);
 		return EXIT_FAILURE;
 	}
 
-	do {
-		fdsrc = open(argv[optind], O_RDONLY);
-		if (fdsrc < 0) {
-			retval = EXIT_FAILURE;
-			perror("cp: could not open source file");
-			break;
+	fdsrc = open(srcpath, O_RDONLY);
+	if (fdsrc < 0) {
+		fprintf(stderr, "cp: could not open source file %s: %s\n", srcpath, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	fddst = open(dstpath, O_WRONLY | O_CREAT | O_TRUNC, DEFFILEMODE);
+	if (fddst < 0) {
+		fprintf(stderr, "cp: could not open destination file %s: %s\n", dstpath, strerror(errno));
+		close(fdsrc);
+		return EXIT_FAILURE;
+	}
+
+	/* Copy in whole destination blocks, skip zeroed blocks only on regular files */
+	chunk = SIZE_CHUNK;
+	sparse = 0;
+	if (fstat(fddst, &dststat) == 0) {
+		sparse = S_ISREG(dststat.st_mode) ? 1 : 0;
+		if ((dststat.st_blksize > 0) && ((dststat.st_blksize & (dststat.st_blksize - 1)) == 0) &&
+				(dststat.st_blksize <= SIZE_BUFF) && ((dststat.st_blksize % sizeof(unsigned long)) == 0)) {
+			chunk = dststat.st_blksize;
+		}
+	}
+	buffsz = SIZE_BUFF - (SIZE_BUFF % chunk);
+
+	for (;;) {
+		/* Fill whole buffer, so chunks stay aligned to the destination blocks */
+		for (cnt = 0; cnt < buffsz; cnt += (size_t)rcnt) {
+			rcnt = read(fdsrc, psh_cp_common.buff + cnt, buffsz - cnt);
+			if (rcnt <= 0) {
+				if ((rcnt < 0) && (errno == EINTR)) {
+					rcnt = 0;
+					continue;
+				}
+				break;
+			}
 		}
 
-		if (fstat(fdsrc, &stat) < 0) {
-			close(fdsrc);
+		if (rcnt < 0) {
 			retval = EXIT_FAILURE;
-			perror("cp: stat failed");
+			fprintf(stderr, "cp: read failure: %s\n", strerror(errno));
 			break;
 		}
 
-		if (!S_ISREG(stat.st_mode)) {
-			close(fdsrc);
+		if ((cnt != 0) && (psh_cp_writeout(fddst, psh_cp_common.buff, cnt, chunk, sparse, &holes) < 0)) {
 			retval = EXIT_FAILURE;
-			fprintf(stderr, "cp: could not open source file: not a regular file\n");
+			fprintf(stderr, "cp: write failure: %s\n", strerror(errno));
 			break;
 		}
+		total += cnt;
 
-		src = fdopen(fdsrc, "r");
-		if (src == NULL) {
-			close(fdsrc);
-			retval = EXIT_FAILURE;
-			perror("cp: could not open source file");
+		if (cnt != buffsz) {
 			break;
 		}
+	}
 
-		if (setvbuf(src, NULL, _IONBF, 0) < 0) {
-			retval = EXIT_FAILURE;
-			fprintf(stderr, "cp: source setvbuff failure\n");
-			break;
+	/* Trailing holes don't extend the file */
+	if ((retval == EXIT_SUCCESS) && (holes != 0) && (ftruncate(fddst, total) < 0)) {
+		retval = EXIT_FAILURE;
+		fprintf(stderr, "cp: write failure: %s\n", strerror(errno));
+	}
+
+	close(fdsrc);
+	if (close(fddst) < 0) {
+		retval = EXIT_FAILURE;
+		perror("cp: write failure");
+	}
+
+	if ((retval == EXIT_SUCCESS) && (psh_cp_common.preserve != 0)) {
+		retval = psh_cp_attrs(dstpath, srcstat);
+	}
+
+	return retval;
+}
+
+
+static int psh_cp_path(const char *srcpath, const char *dstpath, const struct stat *stat);
+
+
+/* Returns 1 if dstpath lies within (or is) the srcpath directory tree */
+static int psh_cp_isinside(const char *srcpath, const char *dstpath)
+{
+	char *dir, *src = NULL, *parent = NULL;
+	size_t len;
+	int ret = 0;
+
+	/* Destination may not exist yet, resolve its parent directory */
+	dir = strdup(dstpath);
+	if (dir != NULL) {
+		src = realpath(srcpath, NULL);
+		parent = realpath(dirname(dir), NULL);
+	}
+
+	if ((src != NULL) && (parent != NULL)) {
+		len = strlen(src);
+		if ((strncmp(parent, src, len) == 0) && ((parent[len] == '\0') || (parent[len] == '/') || (src[len - 1] == '/'))) {
+			ret = 1;
 		}
+	}
 
-		fddst = open(argv[optind + 1], O_WRONLY | O_CREAT, DEFFILEMODE);
-		if (fddst < 0) {
-			if (errno == EISDIR) {
-				filename = basename(argv[optind]);
-				destlen = strlen(argv[optind + 1]);
-				filelen = strlen(filename);
-				destpath = malloc(destlen + filelen + 2);
-				if (destpath == NULL) {
-					retval = EXIT_FAILURE;
-					perror("cp");
-					break;
-				}
+	free(parent);
+	free(src);
+	free(dir);
 
-				strncpy(destpath, argv[optind + 1], destlen);
-				destpath[destlen] = '/';
-				strcpy(destpath + destlen + 1, filename);
+	return ret;
+}
 
-				fddst = open(destpath, O_WRONLY | O_CREAT, DEFFILEMODE);
 
-				if (fddst < 0) {
-					retval = EXIT_FAILURE;
-					perror("cp: could not open destination file");
-					break;
-				}
-			}
-			else {
-				perror("cp: could not open destination file");
-				retval = EXIT_FAILURE;
-				break;
-			}
+static int psh_cp_dir(const char *srcpath, const char *dstpath, const struct stat *stat)
+{
+	int retval = EXIT_SUCCESS;
+	char *src, *dst;
+	struct dirent *entry;
+	struct stat entstat;
+	DIR *dir;
+
+	if ((mkdir(dstpath, stat->st_mode & 0777) < 0) && (errno != EEXIST)) {
+		fprintf(stderr, "cp: could not create directory %s: %s\n", dstpath, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	dir = opendir(srcpath);
+	if (dir == NULL) {
+		fprintf(stderr, "cp: could not open directory %s: %s\n", srcpath, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	while ((entry = readdir(dir)) != NULL) {
+		if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0)) {
+			continue;
 		}
 
-		dst = fdopen(fddst, "w");
-		if (dst == NULL) {
-			close(fddst);
+		if ((psh_common.sigint != 0) || (psh_common.sigquit != 0)) {
 			retval = EXIT_FAILURE;
-			perror("cp: could not open destination file");
 			break;
 		}
 
-		if (setvbuf(dst, NULL, _IONBF, 0) < 0) {
+		src = psh_cp_joinpath(srcpath, entry->d_name);
+		dst = psh_cp_joinpath(dstpath, entry->d_name);
+		if ((src == NULL) || (dst == NULL)) {
+			free(src);
+			free(dst);
 			retval = EXIT_FAILURE;
-			fprintf(stderr, "cp: destination setvbuff failure\n");
 			break;
 		}
 
-		while (1) {
-			cnt = fread_unlocked(buff, sizeof(unsigned char), sizeof(buff), src);
-			if (cnt == 0) {
-				if (ferror(src) != 0) {
-					retval = EXIT_FAILURE;
-					fprintf(stderr, "cp: read failure\n");
-				}
-				break;
-			}
-
-			wcnt = fwrite_unlocked(buff, sizeof(unsigned char), cnt, dst);
-			if (wcnt != cnt) {
-				if (ferror(dst) != 0) {
-					retval = EXIT_FAILURE;
-					fprintf(stderr, "cp: write failure\n");
-				}
-				break;
-			}
+		if (lstat(src, &entstat) < 0) {
+			fprintf(stderr, "cp: stat %s failed: %s\n", src, strerror(errno));
+			retval = EXIT_FAILURE;
+		}
+		else if (psh_cp_path(src, dst, &entstat) != EXIT_SUCCESS) {
+			retval = EXIT_FAILURE;
 		}
-	} while (0);
 
-	if (src != NULL) {
-		fclose(src);
+		free(src);
+		free(dst);
 	}
 
-	if (dst != NULL) {
-		fclose(dst);
+	closedir(dir);
+
+	if ((retval == EXIT_SUCCESS) && (psh_cp_common.preserve != 0)) {
+		retval = psh_cp_attrs(dstpath, stat);
 	}
 
-	if (retval == EXIT_SUCCESS && preserve != 0) {
-		attrpath = (destpath == NULL) ? argv[optind + 1] : destpath;
+	return retval;
+}
 
-		times[0].tv_sec = stat.st_atim.tv_sec;
-		times[1].tv_sec = stat.st_mtim.tv_sec;
-		times[0].tv_usec = 0;
-		times[1].tv_usec = 0;
 
-		if (chown(attrpath, stat.st_uid, stat.st_gid) < 0) {
-			retval = EXIT_FAILURE;
-			perror("cp: destination chown failed");
+static int psh_cp_path(const char *srcpath, const char *dstpath, const struct stat *stat)
+{
+	if (S_ISDIR(stat->st_mode)) {
+		if (psh_cp_common.recursive == 0) {
+			fprintf(stderr, "cp: -r not specified, omitting directory %s\n", srcpath);
+			return EXIT_FAILURE;
 		}
+		return psh_cp_dir(srcpath, dstpath, stat);
+	}
 
-		if (chmod(attrpath, stat.st_mode) < 0) {
-			retval = EXIT_FAILURE;
-			perror("cp: destination chmod failed");
+	if (!S_ISREG(stat->st_mode)) {
+		fprintf(stderr, "cp: could not open source file %s: not a regular file\n", srcpath);
+		return EXIT_FAILURE;
+	}
+
+	return psh_cp_file(srcpath, dstpath, stat);
+}
+
+
+static int psh_cp(int argc, char **argv)
+{
+	char *destpath = NULL, *name;
+	const char *dst;
+	struct stat srcstat, dststat;
+	int c, retval;
+
+	psh_cp_common.preserve = 0;
+	psh_cp_common.recursive = 0;
+
+	while ((c = getopt(argc, argv, "hprR")) != -1) {
+		switch (c) {
+			case 'h':
+				psh_cp_help(argv[0]);
+				return EXIT_SUCCESS;
+			case 'p':
+				psh_cp_common.preserve = 1;
+				break;
+			case 'r':
+			case 'R':
+				psh_cp_common.recursive = 1;
+				break;
+			default:
+				psh_cp_help(argv[0]);
+				return EXIT_FAILURE;
 		}
+	}
 
-		if (utimes(attrpath, times) < 0) {
-			retval = EXIT_FAILURE;
-			perror("cp: destination utimes failed");
+	if (argc - optind != 2) {
+		psh_cp_help(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (stat(argv[optind], &srcstat) < 0) {
+		perror("cp: stat failed");
+		return EXIT_FAILURE;
+	}
+
+	/* Copy into existing directory */
+	dst = argv[optind + 1];
+	if ((stat(dst, &dststat) == 0) && S_ISDIR(dststat.st_mode)) {
+		/* basename() may modify its argument, source path is still needed */
+		name = strdup(argv[optind]);
+		if (name == NULL) {
+			fprintf(stderr, "cp: out of memory\n");
+			return EXIT_FAILURE;
+		}
+		destpath = psh_cp_joinpath(dst, basename(name));
+		free(name);
+		if (destpath == NULL) {
+			return EXIT_FAILURE;
 		}
+		dst = destpath;
+	}
+
+	if (S_ISDIR(srcstat.st_mode) && (psh_cp_common.recursive != 0) && (psh_cp_isinside(argv[optind], dst) != 0)) {
+		fprintf(stderr, "cp: cannot copy directory %s into itself, %s\n", argv[optind], dst);
+		free(destpath);
+		return EXIT_FAILURE;
 	}
 
+	psh_cp_common.buff = mmap(NULL, SIZE_BUFF, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (psh_cp_common.buff == MAP_FAILED) {
+		perror("cp");
+		free(destpath);
+		return EXIT_FAILURE;
+	}
+
+	retval = psh_cp_path(argv[optind], dst, &srcstat);
+
+	(void)munmap(psh_cp_common.buff, SIZE_BUFF);
 	free(destpath);
 
 	return retval;
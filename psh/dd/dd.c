@@ -19,7 +19,10 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdint.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/threads.h>
 
 #include "../psh.h"
 
@@ -33,7 +36,8 @@ struct param_s {
 
 
 enum { param_none = 0, param_if, param_of, param_bs,
-	param_conv, param_count, param_seek, param_skip };
+	param_conv, param_count, param_seek, param_skip, param_bufs, param_status,
+	param_iflag, param_oflag };
 
 
 static const struct param_s params[] = {
@@ -44,22 +48,89 @@ static const struct param_s params[] = {
 	{ "count", param_count },
 	{ "seek", param_seek },
 	{ "skip", param_skip },
+	{ "bufs", param_bufs },
+	{ "status", param_status },
+	{ "iflag", param_iflag },
+	{ "oflag", param_oflag },
 	{ NULL, param_none }
 };
 
 
-enum { conv_none = 0, conv_nocreat, conv_notrunc };
+enum { conv_none = 0, conv_nocreat, conv_notrunc, conv_sparse, conv_fsync };
 
 
 static const struct param_s convs[] = {
 	{ "nocreat", conv_nocreat },
 	{ "notrunc", conv_notrunc },
+	{ "sparse", conv_sparse },
+	{ "fsync", conv_fsync },
 	{ NULL, conv_none }
 };
 
+
+enum { flag_none = 0, flag_sync, flag_direct };
+
+
+static const struct param_s flags[] = {
+	{ "sync", flag_sync },
+	{ "direct", flag_direct },
+	{ NULL, flag_none }
+};
+
+
+enum { status_default = 0, status_none, status_noxfer, status_progress };
+
+
+static const struct param_s statuses[] = {
+	{ "none", status_none },
+	{ "noxfer", status_noxfer },
+	{ "progress", status_progress },
+	{ NULL, status_default }
+};
+
 /* clang-format on */
 
 
+#define DD_READER_STACKSZ 4096
+
+
+typedef struct {
+	int infd;
+	int outfd;
+	const char *infile;
+	const char *outfile;
+	int blocksz;
+	ssize_t inmax;
+	ssize_t intotal;
+	ssize_t outtotal;
+	int status;
+	int err;
+
+	/* Output conversions */
+	unsigned char sparse;
+	unsigned char erased; /* Skipped block pattern, 0xff (erased flash) for non-regular output */
+	unsigned char holes;
+	unsigned char fsync;
+
+	/* Progress reporting */
+	struct timespec start;
+	time_t lastsec;
+	unsigned char progress;
+
+	/* Buffers ring shared with the reader thread */
+	char *buf;
+	ssize_t *lens;
+	int nbufs;
+	int head;
+	int tail;
+	int used;
+	unsigned char eof;
+	unsigned char abort;
+	handle_t lock;
+	handle_t cond;
+} psh_dd_ctx_t;
+
+
 static void psh_dd_info(void)
 {
 	printf("copy a file according to the operands");
@@ -77,7 +148,12 @@ static void psh_dd_usage(void)
 		"\tseek=N      skip N bs-sized blocks at start of output\n"
 		"\tskip=N      skip N bs-sized blocks at start of input\n"
 		"\tconv=CONVS  comma-separated list of supported conversions:\n"
-		"\t            e.g. nocreat,notrunc\n");
+		"\t            nocreat,notrunc,fsync,sparse (seek over zero blocks on\n"
+		"\t            regular files, 0xff blocks on erased devices)\n"
+		"\tiflag=FLAGS comma-separated list of input flags: direct\n"
+		"\toflag=FLAGS comma-separated list of output flags: sync,direct\n"
+		"\tbufs=N      read ahead into N bs-sized buffers in a separate thread\n"
+		"\tstatus=LVL  none, noxfer (no final speed) or progress (periodic stats)\n");
 }
 
 
@@ -133,7 +209,7 @@ static ssize_t getnumber(const char *numstr)
 }
 
 
-static int getconvmode(mode_t *m, const char *str)
+static int getconvmode(mode_t *m, psh_dd_ctx_t *ctx, const char *str)
 {
 	const char *end;
 	const struct param_s *par;
@@ -161,6 +237,14 @@ static int getconvmode(mode_t *m, const char *str)
 				mode &= ~O_TRUNC;
 				break;
 
+			case conv_sparse:
+				ctx->sparse = 1;
+				break;
+
+			case conv_fsync:
+				ctx->fsync = 1;
+				break;
+
 			default:
 				return -EINVAL;
 		}
@@ -172,31 +256,337 @@ static int getconvmode(mode_t *m, const char *str)
 }
 
 
+static int getflagmode(mode_t *m, const char *str, int input)
+{
+	const char *end;
+	const struct param_s *par;
+	mode_t mode = *m;
+
+	for (end = str; *end != '\0'; str = end + 1) {
+		end = strchr(str, ',');
+		if (end == NULL) {
+			end = str + strlen(str);
+		}
+
+		for (par = flags; par->name != NULL; par++) {
+			size_t len = end - str;
+			if ((strncmp(str, par->name, len) == 0) && (par->name[len] == '\0')) {
+				break;
+			}
+		}
+
+		switch (par->value) {
+			case flag_sync:
+				if (input != 0) {
+					return -EINVAL;
+				}
+				mode |= O_SYNC;
+				break;
+
+			case flag_direct:
+				/* Phoenix file servers are accessed without a client-side cache, direct I/O is the default */
+#ifdef O_DIRECT
+				mode |= O_DIRECT;
+#endif
+				break;
+
+			default:
+				return -EINVAL;
+		}
+	}
+
+	*m = mode;
+
+	return EOK;
+}
+
+
+static int getparam(const struct param_s *tab, const char *str)
+{
+	const struct param_s *par;
+
+	for (par = tab; par->name != NULL; par++) {
+		if (strcmp(str, par->name) == 0) {
+			break;
+		}
+	}
+
+	return par->value;
+}
+
+
+static void psh_dd_progress(psh_dd_ctx_t *ctx, int final)
+{
+	struct timespec now;
+	double elapsed;
+
+	if (ctx->status != status_progress) {
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((final == 0) && (now.tv_sec - ctx->lastsec < 1)) {
+		return;
+	}
+	ctx->lastsec = now.tv_sec;
+
+	if (final != 0) {
+		if (ctx->progress != 0) {
+			fprintf(stderr, "\n");
+		}
+		return;
+	}
+
+	elapsed = (now.tv_sec - ctx->start.tv_sec) + (now.tv_nsec - ctx->start.tv_nsec) / 1000000000.0;
+	fprintf(stderr, "\r%zu bytes copied, %.0f s, %.1f kB/s ", (size_t)ctx->outtotal, elapsed,
+		(elapsed > 0.0) ? ((double)ctx->outtotal / elapsed / 1024.0) : 0.0);
+	ctx->progress = 1;
+}
+
+
+static int psh_dd_isblank(const psh_dd_ctx_t *ctx, const char *p, ssize_t len)
+{
+	unsigned long pattern;
+	ssize_t i;
+
+	memset(&pattern, ctx->erased, sizeof(pattern));
+
+	for (i = 0; (i < len) && (((uintptr_t)(p + i) % sizeof(pattern)) != 0); i++) {
+		if ((unsigned char)p[i] != ctx->erased) {
+			return 0;
+		}
+	}
+
+	for (; (i + (ssize_t)sizeof(pattern)) <= len; i += sizeof(pattern)) {
+		if (*(const unsigned long *)(p + i) != pattern) {
+			return 0;
+		}
+	}
+
+	for (; i < len; i++) {
+		if ((unsigned char)p[i] != ctx->erased) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+
+static int psh_dd_output(psh_dd_ctx_t *ctx, const char *p, ssize_t incc)
+{
+	ssize_t outcc;
+
+	/* Seek over full blank blocks instead of writing them */
+	if ((ctx->sparse != 0) && (incc == ctx->blocksz) && (psh_dd_isblank(ctx, p, incc) != 0)) {
+		if (lseek(ctx->outfd, incc, SEEK_CUR) < 0) {
+			perror(ctx->outfile);
+			return -1;
+		}
+		ctx->outtotal += incc;
+		ctx->holes = 1;
+		incc = 0;
+	}
+
+	while (incc > 0) {
+		outcc = write(ctx->outfd, p, incc);
+		if (outcc < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror(ctx->outfile);
+			return -1;
+		}
+		ctx->outtotal += outcc;
+		incc -= outcc;
+		p += outcc;
+	}
+
+	psh_dd_progress(ctx, 0);
+
+	return 0;
+}
+
+
+static ssize_t psh_dd_input(psh_dd_ctx_t *ctx, char *buf)
+{
+	ssize_t incc;
+
+	if ((ctx->inmax != 0) && (ctx->intotal >= ctx->inmax)) {
+		return 0;
+	}
+
+	do {
+		incc = read(ctx->infd, buf, ctx->blocksz);
+	} while ((incc < 0) && (errno == EINTR));
+
+	return incc;
+}
+
+
+static void psh_dd_copy(psh_dd_ctx_t *ctx)
+{
+	ssize_t incc;
+
+	for (;;) {
+		incc = psh_dd_input(ctx, ctx->buf);
+		if (incc <= 0) {
+			if (incc < 0) {
+				perror(ctx->infile);
+			}
+			break;
+		}
+
+		ctx->intotal += incc;
+
+		if (psh_common.sigint != 0) {
+			fprintf(stderr, "Interrupted\n");
+			ctx->err = 1;
+			break;
+		}
+
+		if (psh_dd_output(ctx, ctx->buf, incc) < 0) {
+			ctx->err = 1;
+			break;
+		}
+	}
+}
+
+
+static void psh_dd_reader(void *arg)
+{
+	psh_dd_ctx_t *ctx = arg;
+	ssize_t incc;
+	int slot;
+
+	for (;;) {
+		mutexLock(ctx->lock);
+		while ((ctx->used == ctx->nbufs) && (ctx->abort == 0)) {
+			condWait(ctx->cond, ctx->lock, 0);
+		}
+		slot = ctx->head;
+		mutexUnlock(ctx->lock);
+
+		if (ctx->abort != 0) {
+			break;
+		}
+
+		incc = psh_dd_input(ctx, ctx->buf + (size_t)slot * ctx->blocksz);
+		if (incc < 0) {
+			perror(ctx->infile);
+		}
+
+		mutexLock(ctx->lock);
+		if (incc <= 0) {
+			ctx->eof = 1;
+		}
+		else {
+			ctx->lens[slot] = incc;
+			ctx->intotal += incc;
+			ctx->head = (ctx->head + 1) % ctx->nbufs;
+			ctx->used++;
+		}
+		condBroadcast(ctx->cond);
+		mutexUnlock(ctx->lock);
+
+		if (incc <= 0) {
+			break;
+		}
+	}
+
+	endthread();
+}
+
+
+/* Reader thread fills the ring of bs-sized buffers while we write, so input and output overlap */
+static void psh_dd_copypipe(psh_dd_ctx_t *ctx)
+{
+	void *stack;
+	int slot, tid;
+
+	stack = malloc(DD_READER_STACKSZ);
+	if (stack == NULL) {
+		fprintf(stderr, "Cannot allocate buffer\n");
+		ctx->err = 1;
+		return;
+	}
+
+	if ((mutexCreate(&ctx->lock) < 0) || (condCreate(&ctx->cond) < 0) ||
+			(beginthreadex(psh_dd_reader, priority(-1), stack, DD_READER_STACKSZ, ctx, &tid) < 0)) {
+		fprintf(stderr, "Cannot start reader thread\n");
+		ctx->err = 1;
+		free(stack);
+		return;
+	}
+
+	for (;;) {
+		mutexLock(ctx->lock);
+		while ((ctx->used == 0) && (ctx->eof == 0)) {
+			condWait(ctx->cond, ctx->lock, 0);
+		}
+		slot = ctx->tail;
+		mutexUnlock(ctx->lock);
+
+		if (ctx->used == 0) {
+			break;
+		}
+
+		if (psh_common.sigint != 0) {
+			fprintf(stderr, "Interrupted\n");
+			ctx->err = 1;
+			break;
+		}
+
+		if (psh_dd_output(ctx, ctx->buf + (size_t)slot * ctx->blocksz, ctx->lens[slot]) < 0) {
+			ctx->err = 1;
+			break;
+		}
+
+		mutexLock(ctx->lock);
+		ctx->tail = (ctx->tail + 1) % ctx->nbufs;
+		ctx->used--;
+		condBroadcast(ctx->cond);
+		mutexUnlock(ctx->lock);
+	}
+
+	mutexLock(ctx->lock);
+	ctx->abort = 1;
+	condBroadcast(ctx->cond);
+	mutexUnlock(ctx->lock);
+
+	threadJoin(tid, 0);
+	free(stack);
+	resourceDestroy(ctx->cond);
+	resourceDestroy(ctx->lock);
+}
+
+
 static int psh_dd(int argc, char **argv)
 {
-	struct timespec start_time, end_time;
+	psh_dd_ctx_t ctx;
+	struct timespec end_time;
+	struct stat st;
 	const struct param_s *par;
 	const char *str, *cp;
-	char *buf, *p;
-	int infd, outfd;
-	ssize_t incc, outcc;
-	ssize_t intotal, outtotal;
 	double elapsed_time;
 
 	const char *infile = NULL;
 	const char *outfile = NULL;
 	mode_t outmode = O_CREAT | O_TRUNC;
+	mode_t inmode = 0;
 	ssize_t tmp, count = SSIZE_MAX;
 	ssize_t seekval = 0;
 	ssize_t skipval = 0;
-	ssize_t inmax = 0;
-	int err = 0, blocksz = 512;
+	ssize_t incc;
+	int nbufs = 1, status = status_default, blocksz = 512;
 
 	if ((argc > 1) && (argv[1][0] == '-') && (argv[1][1] == 'h')) {
 		psh_dd_usage();
 		return EXIT_SUCCESS;
 	}
 
+	memset(&ctx, 0, sizeof(ctx));
+
 	while (--argc > 0) {
 		str = *(++argv);
 		cp = strchr(str, '=');
@@ -240,7 +630,7 @@ static int psh_dd(int argc, char **argv)
 				break;
 
 			case param_conv:
-				if (getconvmode(&outmode, cp) < 0) {
+				if (getconvmode(&outmode, &ctx, cp) < 0) {
 					fprintf(stderr, "Invalid conv symbol list\n");
 					return EXIT_FAILURE;
 				}
@@ -270,12 +660,47 @@ static int psh_dd(int argc, char **argv)
 				}
 				break;
 
+			case param_bufs:
+				tmp = getnumber(cp);
+				if ((tmp <= 0) || (tmp > INT_MAX)) {
+					fprintf(stderr, "Bad bufs value\n");
+					return EXIT_FAILURE;
+				}
+				nbufs = tmp;
+				break;
+
+			case param_iflag:
+				if (getflagmode(&inmode, cp, 1) < 0) {
+					fprintf(stderr, "Invalid iflag symbol list\n");
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case param_oflag:
+				if (getflagmode(&outmode, cp, 0) < 0) {
+					fprintf(stderr, "Invalid oflag symbol list\n");
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case param_status:
+				status = getparam(statuses, cp);
+				if (status == status_default) {
+					fprintf(stderr, "Bad status value\n");
+					return EXIT_FAILURE;
+				}
+				break;
+
 			default:
 				fprintf(stderr, "Unknown dd parameter\n");
 				return EXIT_FAILURE;
 		}
 	}
 
+	ctx.blocksz = blocksz;
+	ctx.status = status;
+	ctx.nbufs = nbufs;
+
 	if (skipval > 0) {
 		tmp = skipval;
 		skipval *= blocksz;
@@ -295,153 +720,144 @@ static int psh_dd(int argc, char **argv)
 	}
 
 	if (count != SSIZE_MAX) {
-		inmax = count * blocksz;
+		ctx.inmax = count * blocksz;
 		if (count > SSIZE_MAX / blocksz) {
 			fprintf(stderr, "Transfer total size overflowed\n");
 			return EXIT_FAILURE;
 		}
 	}
 
-	buf = malloc(blocksz);
-	if (buf == NULL) {
+	if ((size_t)nbufs > SIZE_MAX / ((size_t)blocksz + sizeof(ssize_t))) {
 		fprintf(stderr, "Cannot allocate buffer\n");
 		return EXIT_FAILURE;
 	}
 
-	intotal = 0;
-	outtotal = 0;
+	ctx.buf = malloc((size_t)nbufs * blocksz);
+	ctx.lens = malloc((size_t)nbufs * sizeof(ssize_t));
+	if ((ctx.buf == NULL) || (ctx.lens == NULL)) {
+		fprintf(stderr, "Cannot allocate buffer\n");
+		free(ctx.buf);
+		free(ctx.lens);
+		return EXIT_FAILURE;
+	}
 
-	infd = ((infile == NULL) ? fileno(stdin) : open(infile, O_RDONLY));
-	infile = (infile == NULL) ? "stdin" : infile;
-	if (infd < 0) {
-		fprintf(stderr, "'%s': %s\n", infile, strerror(errno));
-		free(buf);
+	ctx.infd = ((infile == NULL) ? fileno(stdin) : open(infile, inmode | O_RDONLY));
+	ctx.infile = (infile == NULL) ? "stdin" : infile;
+	if (ctx.infd < 0) {
+		fprintf(stderr, "'%s': %s\n", ctx.infile, strerror(errno));
+		free(ctx.buf);
+		free(ctx.lens);
 		return EXIT_FAILURE;
 	}
 
-	outfd = ((outfile == NULL) ? fileno(stdout) : open(outfile, outmode | O_WRONLY, 0666));
-	outfile = (outfile == NULL) ? "stdout" : outfile;
-	if (outfd < 0) {
-		fprintf(stderr, "'%s': %s\n", outfile, strerror(errno));
-		if (infd != fileno(stdin)) {
-			close(infd);
+	ctx.outfd = ((outfile == NULL) ? fileno(stdout) : open(outfile, outmode | O_WRONLY, 0666));
+	ctx.outfile = (outfile == NULL) ? "stdout" : outfile;
+	if (ctx.outfd < 0) {
+		fprintf(stderr, "'%s': %s\n", ctx.outfile, strerror(errno));
+		if (ctx.infd != fileno(stdin)) {
+			close(ctx.infd);
 		}
-		free(buf);
+		free(ctx.buf);
+		free(ctx.lens);
 		return EXIT_FAILURE;
 	}
 
-	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	/* Unwritten regions of regular files read as zeros, erased flash reads as 0xff */
+	ctx.erased = ((fstat(ctx.outfd, &st) == 0) && S_ISREG(st.st_mode)) ? 0x00 : 0xff;
+
+	clock_gettime(CLOCK_MONOTONIC, &ctx.start);
+	ctx.lastsec = ctx.start.tv_sec;
 
 	do {
 		if (skipval > 0) {
-			if (lseek(infd, skipval, 0) < 0) {
+			if (lseek(ctx.infd, skipval, 0) < 0) {
 				while (skipval-- > 0) {
-					incc = read(infd, buf, blocksz);
+					incc = read(ctx.infd, ctx.buf, blocksz);
 					if (incc < 0) {
-						perror(infile);
-						err = 1;
+						perror(ctx.infile);
+						ctx.err = 1;
 						break; /* goto cleanup */
 					}
 					if (incc == 0) {
 						fprintf(stderr, "End of file while skipping\n");
-						err = 1;
+						ctx.err = 1;
 						break; /* goto cleanup */
 					}
 				}
 
-				if (err == 1) {
+				if (ctx.err == 1) {
 					break;
 				}
 			}
 		}
 
 		if (seekval > 0) {
-			if (lseek(outfd, seekval, 0) < 0) {
-				perror(outfile);
+			if (lseek(ctx.outfd, seekval, 0) < 0) {
+				perror(ctx.outfile);
 				break;
 			}
 		}
 
-		for (;;) {
-			incc = read(infd, buf, blocksz);
-			if (incc <= 0) {
-				if ((incc < 0) && (errno == EINTR)) {
-					continue;
-				}
-
-				break;
-			}
-
-			intotal += incc;
-			p = buf;
-
-			if (psh_common.sigint != 0) {
-				fprintf(stderr, "Interrupted\n");
-				err = 1;
-				break; /* goto cleanup */
-			}
-
-			while (incc > 0) {
-				outcc = write(outfd, p, incc);
-				if (outcc < 0) {
-					if (errno == EINTR) {
-						continue;
-					}
-					perror(outfile);
-					err = 1;
-					break; /* goto cleanup */
-				}
-				outtotal += outcc;
-				incc -= outcc;
-				p += outcc;
-			}
-
-			if (err == 1) {
-				break;
-			}
+		if (nbufs > 1) {
+			psh_dd_copypipe(&ctx);
+		}
+		else {
+			psh_dd_copy(&ctx);
+		}
 
-			if ((inmax != 0) && (intotal >= inmax)) {
+		/* Trailing skipped blocks have to extend the file */
+		if ((ctx.holes != 0) && (ctx.erased == 0x00)) {
+			off_t offs = lseek(ctx.outfd, 0, SEEK_CUR);
+			if ((offs < 0) || (fstat(ctx.outfd, &st) < 0) || ((st.st_size < offs) && (ftruncate(ctx.outfd, offs) < 0))) {
+				perror(ctx.outfile);
+				ctx.err = 1;
 				break;
 			}
 		}
 
-		if (err == 1) {
-			break;
+		if ((ctx.fsync != 0) && (fsync(ctx.outfd) < 0)) {
+			perror(ctx.outfile);
+			ctx.err = 1;
 		}
-
-		if (incc < 0) {
-			perror(infile);
-		}
-
 	} while (0);
 
 	clock_gettime(CLOCK_MONOTONIC, &end_time);
+	psh_dd_progress(&ctx, 1);
 
 	/* cleanup: */
-	if (infd != fileno(stdin)) {
-		close(infd);
+	if (ctx.infd != fileno(stdin)) {
+		close(ctx.infd);
 	}
 
-	if (outfd != fileno(stdout)) {
-		if (close(outfd) < 0) {
-			perror(outfile);
+	if (ctx.outfd != fileno(stdout)) {
+		if (close(ctx.outfd) < 0) {
+			perror(ctx.outfile);
 		}
 	}
 
-	free(buf);
+	free(ctx.buf);
+	free(ctx.lens);
+
+	if (status == status_none) {
+		return EXIT_SUCCESS;
+	}
 
 	fprintf(stderr, "%zu+%d records in\n",
-		(size_t)(intotal / blocksz),
-		(int)(intotal % blocksz) != 0);
+		(size_t)(ctx.intotal / blocksz),
+		(int)(ctx.intotal % blocksz) != 0);
 
 	fprintf(stderr, "%zu+%d records out\n",
-		(size_t)(outtotal / blocksz),
-		(int)(outtotal % blocksz) != 0);
+		(size_t)(ctx.outtotal / blocksz),
+		(int)(ctx.outtotal % blocksz) != 0);
+
+	if (status == status_noxfer) {
+		return EXIT_SUCCESS;
+	}
 
-	elapsed_time = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_nsec - start_time.tv_nsec) / 1000000000.0;
-	fprintf(stderr, "%zu byte%s copied, ", (size_t)outtotal, ((outtotal != 1) ? "s" : ""));
+	elapsed_time = (end_time.tv_sec - ctx.start.tv_sec) + (end_time.tv_nsec - ctx.start.tv_nsec) / 1000000000.0;
+	fprintf(stderr, "%zu byte%s copied, ", (size_t)ctx.outtotal, ((ctx.outtotal != 1) ? "s" : ""));
 	if (elapsed_time > 0.0) {
-		fprintf(stderr, "%.3f s, %.1f kB/s\n", elapsed_time, (double)outtotal / elapsed_time / 1024.0);
+		fprintf(stderr, "%.3f s, %.1f kB/s\n", elapsed_time, (double)ctx.outtotal / elapsed_time / 1024.0);
 	}
 	else {
 		fprintf(stderr, "speed not estimated\n");
@@ -24,6 +24,25 @@
 #include "../psh.h"
 
 #define LINE_WIDTH 16u
+#define READ_LINES 64u /* Lines read and rendered at once */
+
+/* Max rendered line length: offset, space, group spaces, hex bytes, space, |ascii| and newline */
+#define LINE_SIZE (2u * sizeof(size_t) + 1u + LINE_WIDTH / 8u + 3u * LINE_WIDTH + 1u + (LINE_WIDTH + 2u) + 1u)
+
+_Static_assert(LINE_SIZE == 2u * sizeof(size_t) + 4u * LINE_WIDTH + 7u, "LINE_SIZE must fit line rendered by psh_hd_line()");
+
+
+typedef struct {
+	char *out;
+	size_t outlen;
+	int verbose;
+	int starred;
+	int havelast;
+	uint8_t last[LINE_WIDTH];
+} psh_hd_ctx_t;
+
+
+static const char hexdigits[16] = "0123456789abcdef";
 
 
 static void psh_hd_info(void)
@@ -34,51 +53,126 @@ static void psh_hd_info(void)
 
 static void psh_hd_usage(const char *name)
 {
-	printf("Usage: %s -s offset -n length [filename]\n", name);
+	printf("Usage: %s [-C] [-v] -s offset -n length [filename]\n", name);
+	printf("  -C:  canonical hex+ASCII display (default)\n");
+	printf("  -v:  display all data, don't replace repeated lines with '*'\n");
+	printf("  -h:  shows this help message\n");
 }
 
 
-static void psh_hexdump(const uint8_t *data, size_t ofs, size_t len)
+static size_t psh_hd_offset(char *out, size_t ofs)
 {
-	while (len != 0u) {
-		size_t toprint = min(len, LINE_WIDTH);
+	size_t n = 8u, i;
 
-		printf("%08zx ", (size_t)ofs);
+	while ((n < 2u * sizeof(ofs)) && ((ofs >> (4u * n)) != 0u)) {
+		n++;
+	}
+
+	for (i = n; i > 0u; i--) {
+		out[i - 1u] = hexdigits[ofs & 0xfu];
+		ofs >>= 4;
+	}
 
-		for (size_t i = 0u; i < toprint; i++) {
-			printf(((i & 7u) == 0u) ? " %02x " : "%02x ", data[i]);
+	return n;
+}
+
+
+/* Renders single line in canonical hex+ASCII format, returns its length */
+static size_t psh_hd_line(char *out, const uint8_t *data, size_t ofs, size_t len)
+{
+	char *p = out;
+	size_t i;
+
+	p += psh_hd_offset(p, ofs);
+	*p++ = ' ';
+
+	for (i = 0u; i < LINE_WIDTH; i++) {
+		if ((i & 7u) == 0u) {
+			*p++ = ' ';
 		}
 
-		for (size_t i = toprint; i < LINE_WIDTH; i++) {
-			printf(((i & 7u) == 0u) ? "    " : "   ");
+		if (i < len) {
+			*p++ = hexdigits[data[i] >> 4];
+			*p++ = hexdigits[data[i] & 0xfu];
 		}
+		else {
+			*p++ = ' ';
+			*p++ = ' ';
+		}
+		*p++ = ' ';
+	}
+
+	*p++ = ' ';
+	*p++ = '|';
+	for (i = 0u; i < len; i++) {
+		*p++ = ((data[i] >= 0x20u) && (data[i] < 0x7fu)) ? (char)data[i] : '.';
+	}
+	*p++ = '|';
+	*p++ = '\n';
+
+	return (size_t)(p - out);
+}
+
+
+static int psh_hd_flush(psh_hd_ctx_t *ctx)
+{
+	size_t len = ctx->outlen;
+
+	ctx->outlen = 0u;
+	if ((len != 0u) && (psh_write(STDOUT_FILENO, ctx->out, len) != len)) {
+		return -1;
+	}
+
+	return 0;
+}
+
 
-		printf(" |");
+static int psh_hexdump(psh_hd_ctx_t *ctx, const uint8_t *data, size_t ofs, size_t len)
+{
+	while (len != 0u) {
+		size_t toprint = min(len, LINE_WIDTH);
 
-		for (size_t i = 0u; i < toprint; i++) {
-			printf("%c", (isprint(data[i]) != 0) ? (int)data[i] : (int)'.');
+		/* Collapse repeated full lines into a single '*' */
+		if ((ctx->verbose == 0) && (toprint == LINE_WIDTH) && (ctx->havelast != 0) &&
+				(memcmp(ctx->last, data, LINE_WIDTH) == 0)) {
+			if (ctx->starred == 0) {
+				ctx->out[ctx->outlen++] = '*';
+				ctx->out[ctx->outlen++] = '\n';
+				ctx->starred = 1;
+			}
+		}
+		else {
+			ctx->outlen += psh_hd_line(ctx->out + ctx->outlen, data, ofs, toprint);
+			ctx->starred = 0;
+			ctx->havelast = (toprint == LINE_WIDTH) ? 1 : 0;
+			memcpy(ctx->last, data, toprint);
 		}
 
-		puts("|");
+		if ((ctx->outlen + LINE_SIZE > READ_LINES * LINE_SIZE) && (psh_hd_flush(ctx) < 0)) {
+			return -1;
+		}
 
 		data += toprint;
 		ofs += toprint;
 		len -= toprint;
 	}
+
+	return 0;
 }
 
 
 static int psh_hd(int argc, char **argv)
 {
-	uint8_t buffer[2u * LINE_WIDTH];
+	psh_hd_ctx_t ctx = { 0 };
+	uint8_t *buffer;
 	struct stat st;
 	char *filename = NULL;
-	size_t len = SIZE_MAX;
+	size_t len = SIZE_MAX, filled;
 	off_t ofs = 0;
 
 	for (;;) {
 		char *ptr = NULL;
-		int opt = getopt(argc, argv, "hn:s:");
+		int opt = getopt(argc, argv, "hn:s:Cv");
 		if (opt == -1) {
 			break;
 		}
@@ -91,6 +185,13 @@ static int psh_hd(int argc, char **argv)
 				len = strtoul(optarg, &ptr, 0);
 				break;
 
+			case 'C':
+				continue;
+
+			case 'v':
+				ctx.verbose = 1;
+				continue;
+
 			case 'h':
 				psh_hd_usage(argv[0]);
 				return EXIT_SUCCESS;
@@ -134,31 +235,58 @@ static int psh_hd(int argc, char **argv)
 			}
 		}
 
-		while ((len != 0u) && (psh_common.sigint == 0u)) {
-			ssize_t toprint = read(fd, buffer, (size_t)min(len, sizeof(buffer)));
+		buffer = malloc(READ_LINES * LINE_WIDTH + READ_LINES * LINE_SIZE);
+		if (buffer == NULL) {
+			fprintf(stderr, "%s: %s\n", argv[0], strerror(ENOMEM));
+			if (fd != STDIN_FILENO) {
+				close(fd);
+			}
+			return EXIT_FAILURE;
+		}
+		ctx.out = (char *)buffer + READ_LINES * LINE_WIDTH;
 
-			if (toprint <= 0) {
-				if (toprint == 0) {
-					break;
-				}
-				if ((errno == EAGAIN) || (errno == EINTR)) {
-					continue;
-				}
-				else {
-					fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+		/* Output is written directly to the stdout fd */
+		fflush(stdout);
+
+		while ((len != 0u) && (psh_common.sigint == 0u)) {
+			size_t toread = (size_t)min(len, READ_LINES * LINE_WIDTH);
+			ssize_t rlen = 0;
+
+			/* Read full lines, so repeated lines can be compared */
+			for (filled = 0u; filled < toread; filled += (size_t)rlen) {
+				rlen = read(fd, buffer + filled, toread - filled);
+				if (rlen <= 0) {
+					if ((rlen < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+						rlen = 0;
+						continue;
+					}
 					break;
 				}
 			}
 
-			psh_hexdump(buffer, (size_t)ofs, (size_t)toprint);
+			if (rlen < 0) {
+				fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+			}
+
+			if ((filled != 0u) && (psh_hexdump(&ctx, buffer, (size_t)ofs, filled) < 0)) {
+				break;
+			}
+
+			ofs += (off_t)filled;
+			len -= filled;
 
-			ofs += (off_t)toprint;
-			len -= (size_t)toprint;
+			if (filled != toread) {
+				break;
+			}
 		}
 
 		if (ofs != 0) {
-			printf("%08zx\n", (size_t)ofs);
+			ctx.outlen += psh_hd_offset(ctx.out + ctx.outlen, (size_t)ofs);
+			ctx.out[ctx.outlen++] = '\n';
 		}
+		(void)psh_hd_flush(&ctx);
+
+		free(buffer);
 
 		if (fd != STDIN_FILENO) {
 			close(fd);
@@ -31,8 +31,96 @@
 psh_common_t psh_common = { NULL };
 
 
+/* Merges sorted lists, on equal names entries of a go first (stable) */
+static psh_appentry_t *psh_appmerge(psh_appentry_t *a, psh_appentry_t *b)
+{
+	psh_appentry_t head, *tail = &head;
+
+	while ((a != NULL) && (b != NULL)) {
+		if (strcmp(b->name, a->name) < 0) {
+			tail->next = b;
+			b = b->next;
+		}
+		else {
+			tail->next = a;
+			a = a->next;
+		}
+		tail = tail->next;
+	}
+	tail->next = (a != NULL) ? a : b;
+
+	return head.next;
+}
+
+
+static psh_appentry_t *psh_appsort(psh_appentry_t *list)
+{
+	psh_appentry_t *slow, *fast, *half;
+
+	if ((list == NULL) || (list->next == NULL)) {
+		return list;
+	}
+
+	/* Split list in halves */
+	slow = list;
+	fast = list->next;
+	while ((fast != NULL) && (fast->next != NULL)) {
+		slow = slow->next;
+		fast = fast->next->next;
+	}
+	half = slow->next;
+	slow->next = NULL;
+
+	return psh_appmerge(psh_appsort(list), psh_appsort(half));
+}
+
+
+/* Sorts registered applets and builds lookup index, done once after all applets are registered */
+static void psh_appindex(void)
+{
+	const psh_appentry_t *app;
+	size_t n = 0;
+
+	if (psh_common.appsorted != 0) {
+		return;
+	}
+
+	psh_common.pshapplist = psh_appsort(psh_common.pshapplist);
+	psh_common.appsorted = 1;
+
+	for (app = psh_common.pshapplist; app != NULL; app = app->next) {
+		n++;
+	}
+
+	/* On allocation failure lookups fall back to sorted list scan */
+	psh_common.appidx = malloc(n * sizeof(*psh_common.appidx));
+	if (psh_common.appidx != NULL) {
+		n = 0;
+		for (app = psh_common.pshapplist; app != NULL; app = app->next) {
+			/*
+			 * Registration prepends and the sort is stable, so the most recently registered
+			 * applet of a duplicated name comes first (as with the former sorted insert).
+			 * Only that one is indexed, bsearch() could return any of equal entries.
+			 */
+			if ((n != 0) && (strcmp(psh_common.appidx[n - 1]->name, app->name) == 0)) {
+				continue;
+			}
+			psh_common.appidx[n++] = app;
+		}
+		psh_common.appcnt = n;
+	}
+}
+
+
+static int psh_appcmp(const void *key, const void *elem)
+{
+	return strcmp((const char *)key, (*(const psh_appentry_t *const *)elem)->name);
+}
+
+
 const psh_appentry_t *psh_applist_first(void)
 {
+	psh_appindex();
 	return psh_common.pshapplist;
 }
 
@@ -48,21 +136,15 @@ const psh_appentry_t *psh_applist_next(const psh_appentry_t *current)
 
 void psh_registerapp(psh_appentry_t *newapp)
 {
-	psh_appentry_t *prevapp = NULL;
-
-	/* find position */
+	/* Applets are sorted lazily on first lookup */
 	newapp->next = psh_common.pshapplist;
-	while ((newapp->next != NULL) && (strcmp(newapp->next->name, newapp->name) < 0)) {
-		prevapp = newapp->next;
-		newapp->next = prevapp->next;
-	}
+	psh_common.pshapplist = newapp;
 
-	/* insert */
-	if (prevapp == NULL) {
-		psh_common.pshapplist = newapp;
-	}
-	else {
-		prevapp->next = newapp;
+	if (psh_common.appsorted != 0) {
+		free(psh_common.appidx);
+		psh_common.appidx = NULL;
+		psh_common.appcnt = 0;
+		psh_common.appsorted = 0;
 	}
 
 	return;
@@ -71,7 +153,16 @@ void psh_registerapp(psh_appentry_t *newapp)
 
 const psh_appentry_t *psh_findapp(char *appname)
 {
+	const psh_appentry_t *const *entry;
 	const psh_appentry_t *app;
+
+	psh_appindex();
+
+	if (psh_common.appidx != NULL) {
+		entry = bsearch(appname, psh_common.appidx, psh_common.appcnt, sizeof(*psh_common.appidx), psh_appcmp);
+		return (entry != NULL) ? *entry : NULL;
+	}
+
 	for (app = psh_common.pshapplist; app != NULL; app = app->next) {
 		if (strcmp(appname, app->name) == 0) {
 			break;
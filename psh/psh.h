@@ -14,8 +14,9 @@
 #ifndef _PSH_H_
 #define _PSH_H_
 
-/* Exit code based on POSIX - Shell Command Language */
+/* Exit codes based on POSIX - Shell Command Language */
 #define PSH_UNKNOWN_CMD 127
+#define SIGNAL_SHIFT    128 /* Added to signal number of a command terminated by signal */
 
 
 typedef struct psh_app {
@@ -28,6 +29,9 @@ typedef struct psh_app {
 
 typedef struct {
 	psh_appentry_t *pshapplist;
+	const psh_appentry_t **appidx; /* Applets sorted by name for binary search lookup */
+	size_t appcnt;
+	unsigned char appsorted;
 	char *ttydev;
 	volatile unsigned char sigint;  /* Received SIGINT */
 	volatile unsigned char sigquit; /* Received SIGQUIT */
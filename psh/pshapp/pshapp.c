@@ -29,6 +29,7 @@
 
 #include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/msg.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/pwman.h>
@@ -42,8 +43,15 @@
 /* Shell definitions */
 #define PROMPT       "(psh)% " /* Shell prompt */
 #define SCRIPT_MAGIC ":{}:"    /* Every psh script should start with this line */
+#define SCRIPT_POLLUS 10000    /* Script dependencies polling interval (us) */
+#define SCRIPT_DEPTMO 30       /* Script path dependency timeout (s) */
 #define CMDSZ        128       /* Command buffer size */
 #define HISTSZ       512       /* Command history size */
+#define PIPE_SEP     "|"       /* Pipeline stages separator */
+
+#ifndef PSH_PATH
+#define PSH_PATH "/bin/psh" /* psh multi-call binary used to run builtin applets in pipeline stages */
+#endif
 
 
 /* Misc definitions */
@@ -136,6 +144,10 @@ struct psh_redir {
 pshapp_common_t pshapp_common;
 
 
+/* Unquoted pipeline separator token */
+static char pshapp_pipesep[] = PIPE_SEP;
+
+
 void _psh_exit(int code)
 {
 	keepidle(0);
@@ -1047,38 +1059,89 @@ static int psh_readcmd(struct termios *orig, psh_hist_t *cmdhist, char **cmd)
 }
 
 
-static int psh_parsecmd(char *line, int *argc, char ***argv)
+/* Splits line into arguments with quotes removed, returns number of arguments (counts only if argv is NULL) */
+static int psh_splitcmd(const char *line, char *buff, char **argv)
 {
-	char *cmd, *arg, **rargv;
-
-	cmd = strtok(line, "\t ");
-	if (cmd == NULL) {
-		return -EINVAL;
-	}
-	*argv = malloc(2 * sizeof(char *));
-	if (*argv == NULL) {
-		return -ENOMEM;
-	}
-
-	*argc = 0;
-	(*argv)[(*argc)++] = cmd;
+	char quote;
+	int n = 0;
 
 	for (;;) {
-		arg = strtok(NULL, "\t ");
-		if (arg == NULL) {
+		while ((*line == ' ') || (*line == '\t')) {
+			line++;
+		}
+
+		if (*line == '\0') {
 			break;
 		}
 
-		rargv = realloc(*argv, (*argc + 2) * sizeof(char *));
-		if (rargv == NULL) {
-			free(*argv);
-			return -ENOMEM;
+		/* Only unquoted '|' separates pipeline stages, it's told apart by the token address */
+		if (*line == '|') {
+			if (argv != NULL) {
+				argv[n] = pshapp_pipesep;
+			}
+			n++;
+			line++;
+			continue;
+		}
+
+		if (argv != NULL) {
+			argv[n] = buff;
+		}
+		n++;
+
+		for (quote = '\0'; *line != '\0'; line++) {
+			if (quote != '\0') {
+				if (*line == quote) {
+					quote = '\0';
+					continue;
+				}
+			}
+			else if ((*line == '"') || (*line == '\'')) {
+				quote = *line;
+				continue;
+			}
+			else if ((*line == ' ') || (*line == '\t') || (*line == '|')) {
+				break;
+			}
+
+			if (argv != NULL) {
+				*buff++ = *line;
+			}
 		}
 
-		*argv = rargv;
-		(*argv)[(*argc)++] = arg;
+		if (quote != '\0') {
+			return -EINVAL;
+		}
+
+		if (argv != NULL) {
+			*buff++ = '\0';
+		}
 	}
 
+	return n;
+}
+
+
+static int psh_parsecmd(const char *line, int *argc, char ***argv)
+{
+	int n;
+
+	n = psh_splitcmd(line, NULL, NULL);
+	if (n < 0) {
+		fprintf(stderr, "psh: Syntax error\n");
+		return n;
+	}
+	else if (n == 0) {
+		return -EINVAL;
+	}
+
+	/* Arguments are stored after argv[] in the same allocation, line is left intact */
+	*argv = malloc((n + 1) * sizeof(char *) + strlen(line) + 1);
+	if (*argv == NULL) {
+		return -ENOMEM;
+	}
+
+	*argc = psh_splitcmd(line, (char *)(*argv + n + 1), *argv);
 	(*argv)[*argc] = NULL;
 
 	return 0;
@@ -1284,8 +1347,483 @@ static int psh_streamRestore(struct psh_redir *redir)
 	return err;
 }
 
+
+static const psh_appentry_t *psh_findcmd(char *cmd)
+{
+	const psh_appentry_t *app;
+	const char *tmp;
+	int cnt;
+
+	app = psh_findapp(cmd);
+	if (app == NULL) {
+
+		/* Allow executable path start with "/", "./", "../" */
+		cnt = 0;
+		for (tmp = cmd; *tmp; tmp++) {
+			if (*tmp != '.') {
+				if (*tmp != '/') {
+					cnt = 3;
+				}
+				break;
+			}
+			cnt++;
+		}
+
+		if (((cnt < 3) && (*tmp == '/')) || (isalnum(cmd[0]) != 0)) {
+			app = psh_findapp("/");
+		}
+	}
+
+	return app;
+}
+
+
+/* Spawns single pipeline stage, stdin/stdout are taken from fdin/fdout unless redirected explicitly */
+static pid_t psh_spawnstage(char **argv, int fdin, int fdout, int fdclose, pid_t pgid, struct psh_redir *redir)
+{
+	const psh_appentry_t *app;
+	const char *path;
+	pid_t pid;
+	int i, fd;
+
+	app = psh_findcmd(argv[0]);
+	if (app == NULL) {
+		fprintf(stderr, "psh: %s: unknown command\n", argv[0]);
+		return -ENOENT;
+	}
+
+	/* Builtin applets are run by a new instance of the psh multi-call binary */
+	path = (strcmp(app->name, "/") == 0) ? argv[0] : PSH_PATH;
+
+	pid = vfork();
+	if (pid < 0) {
+		fprintf(stderr, "psh: vfork failed with code %d\n", pid);
+		return pid;
+	}
+	else if (pid == 0) {
+		if (setpgid(0, pgid) < 0) {
+			_psh_exit(EXIT_FAILURE);
+		}
+
+		for (i = 0; i < PSH_REDIRSZ; i++) {
+			fd = redir->red[i];
+			if (fd < 0) {
+				if (i == STDIN_FILENO) {
+					fd = fdin;
+				}
+				else if (i == STDOUT_FILENO) {
+					fd = fdout;
+				}
+			}
+
+			if ((fd >= 0) && (fd != i) && (dup2(fd, i) < 0)) {
+				_psh_exit(EXIT_FAILURE);
+			}
+		}
+
+		for (i = 0; i < PSH_REDIRSZ; i++) {
+			if (redir->red[i] > STDERR_FILENO) {
+				close(redir->red[i]);
+			}
+		}
+
+		if (fdin > STDERR_FILENO) {
+			close(fdin);
+		}
+
+		if (fdout > STDERR_FILENO) {
+			close(fdout);
+		}
+
+		if (fdclose > STDERR_FILENO) {
+			close(fdclose);
+		}
+
+		execv(path, argv);
+		fprintf(stderr, "psh: %s: exec failed with code %d\n", argv[0], -errno);
+		_psh_exit(EXIT_FAILURE);
+	}
+
+	/* Set process group also in parent to avoid race with tcsetpgrp() */
+	(void)setpgid(pid, (pgid == 0) ? pid : pgid);
+
+	return pid;
+}
+
+
+/* Runs cmd1 | cmd2 | ... with all stages executing concurrently, returns exit status of the last stage */
+static int psh_runpipeline(int argc, char **argv)
+{
+	struct psh_redir redir;
+	int i, n, stage, nstages = 1, status = 0, retval = 0, fdin = -1, fds[2];
+	pid_t *pids, pgid = 0, ret;
+
+	for (i = 0; i < argc; i++) {
+		if (argv[i] == pshapp_pipesep) {
+			if ((i == 0) || (i == argc - 1) || (argv[i - 1] == NULL)) {
+				fprintf(stderr, "psh: Syntax error\n");
+				return PSH_UNKNOWN_CMD;
+			}
+			/* Terminate previous stage argv */
+			argv[i] = NULL;
+			nstages++;
+		}
+	}
+
+	pids = malloc(nstages * sizeof(pid_t));
+	if (pids == NULL) {
+		fprintf(stderr, "psh: out of memory\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0, stage = 0; i < argc; stage++) {
+		char **sargv = &argv[i];
+		int sargc = 0;
+
+		while (sargv[sargc] != NULL) {
+			sargc++;
+		}
+		i += sargc + 1;
+
+		fds[0] = -1;
+		fds[1] = -1;
+		if ((stage < nstages - 1) && (pipe(fds) < 0)) {
+			fprintf(stderr, "psh: failed to create pipe: %s\n", strerror(errno));
+			retval = EXIT_FAILURE;
+			break;
+		}
+
+		for (n = 0; n < PSH_REDIRSZ; n++) {
+			redir.save[n] = -1;
+		}
+
+		if ((psh_parseRedirections(&sargc, &sargv, &redir) < 0) || (sargv[0] == NULL)) {
+			if (sargv[0] == NULL) {
+				fprintf(stderr, "psh: Syntax error\n");
+				psh_redirCleanup(&redir);
+			}
+			retval = PSH_UNKNOWN_CMD;
+		}
+		else {
+			pids[stage] = psh_spawnstage(sargv, fdin, fds[1], fds[0], pgid, &redir);
+			psh_redirCleanup(&redir);
+			if (pids[stage] < 0) {
+				retval = PSH_UNKNOWN_CMD;
+			}
+			else if (pgid == 0) {
+				pgid = pids[stage];
+			}
+		}
+
+		/* Parent doesn't need the ends passed to the stage */
+		if (fdin >= 0) {
+			close(fdin);
+		}
+		if (fds[1] >= 0) {
+			close(fds[1]);
+		}
+		fdin = fds[0];
+
+		if (retval != 0) {
+			break;
+		}
+	}
+
+	if (fdin >= 0) {
+		close(fdin);
+	}
+
+	if (pgid != 0) {
+		/* Hand terminal to the pipeline process group */
+		tcsetpgrp(STDIN_FILENO, pgid);
+
+		for (i = 0; i < stage; i++) {
+			do {
+				ret = waitpid(pids[i], &status, 0);
+			} while ((ret < 0) && (errno == EINTR));
+
+			if ((i == nstages - 1) && (retval == 0)) {
+				if (ret < 0) {
+					retval = EXIT_FAILURE;
+				}
+				else if (WIFSIGNALED(status) != 0) {
+					retval = SIGNAL_SHIFT + WTERMSIG(status);
+				}
+				else {
+					retval = WEXITSTATUS(status);
+				}
+			}
+		}
+
+		/* Take back terminal control */
+		tcsetpgrp(STDIN_FILENO, getpgid(getpid()));
+	}
+
+	free(pids);
+
+	return retval;
+}
+
+
+/*
+ * Script lines of form X[deps] or W[deps] (deps is comma separated, possibly empty list) form a batch
+ * of jobs started concurrently as soon as their dependencies are met. Dependency starting with '/' is a path
+ * which has to appear in the filesystem, other dependencies name earlier jobs of the batch (by executable
+ * basename) - X job is met when started, W job when it exits. Any other script line waits for the whole batch.
+ */
+enum { job_pending = 0, job_running, job_done };
+
+
+typedef struct {
+	char *line;     /* Line copy, holds argv[] and deps strings */
+	char **argv;
+	const char *name;
+	char *deps;
+	int ndeps;
+	int lineno;
+	pid_t pid;
+	char type;
+	char state;
+} psh_scriptjob_t;
+
+
+typedef struct {
+	psh_scriptjob_t *jobs;
+	int n;
+	int size;
+} psh_scriptbatch_t;
+
+
+static pid_t psh_scriptspawn(char **argv, int lineno)
+{
+	pid_t pid;
+
+	pid = vfork();
+	if (pid < 0) {
+		fprintf(stderr, "psh: vfork failed in line %d\n", lineno);
+	}
+	else if (pid == 0) {
+		execv(argv[0], argv);
+		fprintf(stderr, "psh: exec failed in line %d\n", lineno);
+		_psh_exit(EXIT_FAILURE);
+	}
+
+	return pid;
+}
+
+
+static int psh_scriptbatchadd(psh_scriptbatch_t *batch, const char *line, int lineno)
+{
+	psh_scriptjob_t *job, *rjobs;
+	char *end, *dep, *cmd;
+	int argc, err;
+
+	if (batch->n == batch->size) {
+		rjobs = realloc(batch->jobs, (batch->size + 8) * sizeof(*rjobs));
+		if (rjobs == NULL) {
+			fprintf(stderr, "psh: out of memory\n");
+			return -ENOMEM;
+		}
+		batch->jobs = rjobs;
+		batch->size += 8;
+	}
+	job = &batch->jobs[batch->n];
+
+	job->line = strdup(line);
+	if (job->line == NULL) {
+		fprintf(stderr, "psh: out of memory\n");
+		return -ENOMEM;
+	}
+
+	end = strchr(job->line, ']');
+	if (end == NULL) {
+		fprintf(stderr, "psh: missing ']' in line %d\n", lineno);
+		free(job->line);
+		return -EINVAL;
+	}
+	*end = '\0';
+	cmd = end + 1;
+
+	job->deps = &job->line[2];
+	job->ndeps = 0;
+	for (dep = job->deps; *dep != '\0'; dep = end + 1) {
+		end = strchr(dep, ',');
+		if (end != NULL) {
+			*end = '\0';
+		}
+
+		if (*dep != '\0') {
+			job->ndeps++;
+		}
+
+		if (end == NULL) {
+			break;
+		}
+	}
+
+	err = psh_parsecmd(cmd, &argc, &job->argv);
+	if (err < 0) {
+		fprintf(stderr, "psh: failed to parse line %d\n", lineno);
+		free(job->line);
+		return err;
+	}
+
+	job->name = strrchr(job->argv[0], '/');
+	job->name = (job->name != NULL) ? job->name + 1 : job->argv[0];
+	job->lineno = lineno;
+	job->pid = -1;
+	job->type = line[0];
+	job->state = job_pending;
+	batch->n++;
+
+	return 0;
+}
+
+
+/* Returns 1 if dependencies are met, 0 if not yet, -ENOENT if a path dependency is not met */
+static int psh_scriptjobready(psh_scriptbatch_t *batch, psh_scriptjob_t *job)
+{
+	const char *dep = job->deps; /* Separators were replaced with '\0', deps are stored one after another */
+	oid_t oid;
+	int i, j, ret = 1;
+
+	for (i = 0; i < job->ndeps; dep += strlen(dep) + 1) {
+		if (*dep == '\0') {
+			continue;
+		}
+		i++;
+
+		if (*dep == '/') {
+			if (lookup(dep, NULL, &oid) < 0) {
+				return -ENOENT;
+			}
+			continue;
+		}
+
+		/* Dependency on a name not present in the batch is met by the earlier script lines */
+		for (j = 0; j < batch->n; j++) {
+			if ((strcmp(batch->jobs[j].name, dep) == 0) && (batch->jobs[j].state != job_done)) {
+				ret = 0;
+			}
+		}
+	}
+
+	return ret;
+}
+
+
+static void psh_scriptbatchfree(psh_scriptbatch_t *batch)
+{
+	psh_scriptjob_t *job;
+	int i;
+
+	/* Don't leave started jobs behind */
+	for (i = 0; i < batch->n; i++) {
+		job = &batch->jobs[i];
+		if (job->state == job_running) {
+			(void)waitpid(job->pid, NULL, 0);
+		}
+		free(job->argv);
+		free(job->line);
+	}
+	batch->n = 0;
+}
+
+
+static int psh_scriptbatchrun(psh_scriptbatch_t *batch)
+{
+	psh_scriptjob_t *job;
+	int i, ready, progress, running, blocked, err = 0, remaining = batch->n;
+	unsigned int waited = 0;
+	pid_t pid;
+
+	while ((remaining > 0) && (err == 0)) {
+		progress = 0;
+		running = 0;
+		blocked = 0;
+
+		for (i = 0; i < batch->n; i++) {
+			job = &batch->jobs[i];
+
+			if (job->state == job_running) {
+				do {
+					pid = waitpid(job->pid, NULL, WNOHANG);
+				} while ((pid < 0) && (errno == EINTR));
+
+				if (pid > 0) {
+					job->state = job_done;
+					remaining--;
+					progress = 1;
+				}
+				else if (pid == 0) {
+					running++;
+				}
+				else {
+					err = -errno;
+					fprintf(stderr, "psh: waitpid failed in line %d\n", job->lineno);
+					break;
+				}
+				continue;
+			}
+
+			if (job->state != job_pending) {
+				continue;
+			}
+
+			ready = psh_scriptjobready(batch, job);
+			if (ready <= 0) {
+				blocked += (ready < 0) ? 1 : 0;
+				continue;
+			}
+
+			job->pid = psh_scriptspawn(job->argv, job->lineno);
+			if (job->pid < 0) {
+				err = job->pid;
+				break;
+			}
+
+			progress = 1;
+			if (job->type == 'W') {
+				job->state = job_running;
+				running++;
+			}
+			else {
+				job->state = job_done;
+				remaining--;
+			}
+		}
+
+		if ((err < 0) || (progress != 0)) {
+			continue;
+		}
+
+		if ((running == 0) && (blocked == 0)) {
+			fprintf(stderr, "psh: circular script dependencies\n");
+			err = -EINVAL;
+		}
+		else if ((running == 0) && (waited >= SCRIPT_DEPTMO * 1000000u)) {
+			for (i = 0; i < batch->n; i++) {
+				if (batch->jobs[i].state == job_pending) {
+					fprintf(stderr, "psh: dependency timeout in line %d\n", batch->jobs[i].lineno);
+				}
+			}
+			err = -ETIMEDOUT;
+		}
+		else {
+			usleep(SCRIPT_POLLUS);
+			waited += (running == 0) ? SCRIPT_POLLUS : 0;
+		}
+	}
+
+	psh_scriptbatchfree(batch);
+
+	return err;
+}
+
+
 static int psh_runscript(char *path)
 {
+	psh_scriptbatch_t batch = { NULL, 0, 0 };
 	static const char *scriptCmds[] = { "export", "unset" };
 	char **argv = NULL, *line = NULL;
 	int i, err = 0, argc = 0;
@@ -1326,6 +1864,12 @@ static int psh_runscript(char *path)
 		if (line[0] == '#') {
 			continue;
 		}
+		else if (((line[0] == 'X') || (line[0] == 'W')) && (line[1] == '[')) {
+			err = psh_scriptbatchadd(&batch, line, i);
+		}
+		else if ((err = psh_scriptbatchrun(&batch)) < 0) {
+			break;
+		}
 		else if ((line[0] == 'X') || (line[0] == 'W') || (line[0] == 'T')) {
 			do {
 				err = psh_parsecmd(&line[1], &argc, &argv);
@@ -1339,17 +1883,11 @@ static int psh_runscript(char *path)
 					err = psh_ttyopen(argv[0]);
 					break;
 				}
-				pid = vfork();
+				pid = psh_scriptspawn(argv, i);
 				if (pid < 0) {
-					fprintf(stderr, "psh: vfork failed in line %d\n", i);
 					err = pid;
 					break;
 				}
-				else if (pid == 0) {
-					execv(argv[0], argv);
-					fprintf(stderr, "psh: exec failed in line %d\n", i);
-					_psh_exit(EXIT_FAILURE);
-				}
 
 				if (line[0] == 'W') {
 					err = waitpid(pid, NULL, 0);
@@ -1400,6 +1938,14 @@ static int psh_runscript(char *path)
 		}
 	}
 
+	if (err >= 0) {
+		err = psh_scriptbatchrun(&batch);
+	}
+	else {
+		psh_scriptbatchfree(&batch);
+	}
+	free(batch.jobs);
+
 	free(line);
 	fclose(stream);
 
@@ -1566,7 +2112,7 @@ static int psh_run(int exitable, const char *console)
 	psh_histent_t *entry;
 	const psh_appentry_t *app;
 	struct termios orig;
-	char *tmp, *cmd, **argv;
+	char *cmd, **argv;
 	int cnt, err, argc, retries;
 	pid_t pgrp;
 
@@ -1686,6 +2232,26 @@ static int psh_run(int exitable, const char *console)
 			cmdhist->hb = (cmdhist->hb + 1) % HISTSZ;
 		}
 
+		/* Clear signals */
+		psh_common.sigint = 0;
+		psh_common.sigquit = 0;
+		psh_common.sigstop = 0;
+
+		/* Run pipeline */
+		for (cnt = 0; cnt < argc; cnt++) {
+			if (argv[cnt] == pshapp_pipesep) {
+				break;
+			}
+		}
+
+		if (cnt < argc) {
+			err = psh_runpipeline(argc, argv);
+			psh_common.exitStatus = err;
+			free(argv);
+			fflush(NULL);
+			continue;
+		}
+
 		if (psh_parseRedirections(&argc, &argv, &redir) < 0) {
 			free(argv);
 			continue;
@@ -1697,34 +2263,11 @@ static int psh_run(int exitable, const char *console)
 			continue;
 		}
 
-		/* Clear signals */
-		psh_common.sigint = 0;
-		psh_common.sigquit = 0;
-		psh_common.sigstop = 0;
-
 		/* Reset getopt */
 		optind = 0;
 
 		/* Find and run */
-		app = psh_findapp(argv[0]);
-		if (app == NULL) {
-
-			/* Allow executable path start with "/", "./", "../" */
-			cnt = 0;
-			for (tmp = argv[0]; *tmp; tmp++) {
-				if (*tmp != '.') {
-					if (*tmp != '/') {
-						cnt = 3;
-					}
-					break;
-				}
-				cnt++;
-			}
-
-			if (((cnt < 3) && (*tmp == '/')) || (isalnum(argv[0][0]) != 0)) {
-				app = psh_findapp("/");
-			}
-		}
+		app = psh_findcmd(argv[0]);
 
 		if (app != NULL) {
 			err = psh_streamRedirect(&redir);
@@ -22,8 +22,6 @@
 
 #include "../psh.h"
 
-#define SIGNAL_SHIFT 128
-
 
 int psh_runfile(int argc, char **argv)
 {
@@ -28,10 +28,15 @@
 #include "../psh.h"
 
 
+enum { fmt_csv = 0, fmt_json };
+
+
 static struct {
 	int sortdir;
 	int threads;
 	int (*cmp)(const void *, const void *);
+	unsigned int prevcnt;
+	time_t *dcpu;
 } psh_top_common;
 
 
@@ -50,6 +55,14 @@ static int psh_top_cmppid(const void *t1, const void *t2)
 }
 
 
+static int psh_top_cmptid(const void *t1, const void *t2)
+{
+	const threadinfo_t *i1 = t1, *i2 = t2;
+
+	return (i1->tid > i2->tid) - (i1->tid < i2->tid);
+}
+
+
 static int psh_top_cmptime(const void *t1, const void *t2)
 {
 	return ((int)((threadinfo_t *)t1)->cpuTime - (int)((threadinfo_t *)t2)->cpuTime) * psh_top_common.sortdir;
@@ -68,7 +81,9 @@ static void psh_top_help(void)
 	printf("  -h:  prints help\n");
 	printf("  -H:  starts with threads mode\n");
 	printf("  -d:  sets refresh rate (integer greater than 0)\n");
-	printf("  -n:  sets number of iterations (by default its infinity)\n\n");
+	printf("  -n:  sets number of iterations (by default its infinity)\n");
+	printf("  -b:  batch mode, prints per thread samples as CSV lines\n");
+	printf("  -j:  prints batch mode samples as JSON lines\n\n");
 	printf("Interactive commands:\n");
 	printf("   <ENTER> or <SPACE>:  refresh\n");
 	printf("   H:  toggle threads mode\n");
@@ -119,50 +134,89 @@ static int psh_top_waitcmd(unsigned int secs)
 }
 
 
-static void psh_top_refresh(char cmd, threadinfo_t *info, threadinfo_t *previnfo, unsigned int totcnt, time_t delta)
+/* Calculates load (and optionally cpuTime deltas), leaves info sorted by tid */
+static void psh_top_load(threadinfo_t *info, threadinfo_t *previnfo, unsigned int totcnt, time_t delta, time_t *dcpu)
 {
-	struct winsize ws;
-	static unsigned int prevcnt = 0;
-	unsigned int i, j, m, s, hs, w, lines = 3, runcnt = 0, waitcnt = 0;
-	char buff[8];
+	unsigned int i, j, prevcnt = psh_top_common.prevcnt;
 
-	/* Calculate load */
-	for (i = 0; i < totcnt; i++) {
-		threadinfo_t *p = NULL;
-		for (j = 0; j < prevcnt; j++) {
-			if (info[i].tid == previnfo[j].tid) {
-				p = &previnfo[j];
-				break;
-			}
-		}
+	/* Both samples are sorted by tid, so previous samples are found in a single merge pass */
+	qsort(info, totcnt, sizeof(threadinfo_t), psh_top_cmptid);
+	for (i = 0, j = 0; i < totcnt; i++) {
+		while ((j < prevcnt) && (previnfo[j].tid < info[i].tid))
+			j++;
+
+		if (dcpu != NULL)
+			dcpu[i] = 0;
 
 		/* Prevent negative load if a new thread with the same tid has occured */
-		if (p)
-			info[i].load = (info[i].cpuTime > p->cpuTime) ? (info[i].cpuTime - p->cpuTime) * 1000 / delta : 0;
+		if ((j < prevcnt) && (previnfo[j].tid == info[i].tid)) {
+			info[i].load = (info[i].cpuTime > previnfo[j].cpuTime) ? (info[i].cpuTime - previnfo[j].cpuTime) * 1000 / delta : 0;
+			if ((dcpu != NULL) && (info[i].cpuTime > previnfo[j].cpuTime))
+				dcpu[i] = info[i].cpuTime - previnfo[j].cpuTime;
+		}
 	}
 
-	prevcnt = totcnt;
+	psh_top_common.prevcnt = totcnt;
 	memcpy(previnfo, info, totcnt * sizeof(threadinfo_t));
+}
 
-	if (!psh_top_common.threads) {
-		qsort(info, totcnt, sizeof(threadinfo_t), psh_top_cmppid);
-		for (i = 0; i < totcnt; i++) {
-			info[i].tid = 1;
-
-			for (j = i + 1; j < totcnt && info[j].pid == info[i].pid; j++) {
-				info[i].tid++;
-				info[i].load += info[j].load;
-				info[i].cpuTime += info[j].cpuTime;
-				info[i].priority = min(info[i].priority, info[j].priority);
-				info[i].state = min(info[i].state, info[j].state);
-				info[i].wait = max(info[i].wait, info[j].wait);
+
+static void psh_top_batch(int fmt, threadinfo_t *info, unsigned int totcnt, time_t now)
+{
+	unsigned int i;
+	const char *c;
+
+	for (i = 0; i < totcnt; i++) {
+		if (fmt == fmt_json) {
+			printf("{\"time\":%lld,\"pid\":%u,\"tid\":%u,\"ppid\":%u,\"priority\":%d,\"state\":\"%s\","
+				"\"cputime\":%lld,\"dcputime\":%lld,\"load\":%u,\"vmem\":%u,\"name\":\"",
+				(long long)now, (unsigned int)info[i].pid, (unsigned int)info[i].tid, (unsigned int)info[i].ppid, info[i].priority,
+				(info[i].state) ? "sleep" : "ready", (long long)info[i].cpuTime, (long long)psh_top_common.dcpu[i],
+				(unsigned int)info[i].load, (unsigned int)info[i].vmem);
+
+			for (c = info[i].name; (*c != '\0') && (c < info[i].name + sizeof(info[i].name)); c++) {
+				if ((*c == '"') || (*c == '\\'))
+					putchar('\\');
+				putchar(*c);
 			}
+			printf("\"}\n");
+		}
+		else {
+			printf("%lld,%u,%u,%u,%d,%s,%lld,%lld,%u,%u,%.*s\n", (long long)now, (unsigned int)info[i].pid,
+				(unsigned int)info[i].tid, (unsigned int)info[i].ppid, info[i].priority, (info[i].state) ? "sleep" : "ready",
+				(long long)info[i].cpuTime, (long long)psh_top_common.dcpu[i], (unsigned int)info[i].load,
+				(unsigned int)info[i].vmem, (int)sizeof(info[i].name), info[i].name);
+		}
+	}
+}
+
+
+static void psh_top_refresh(char cmd, threadinfo_t *info, threadinfo_t *previnfo, unsigned int totcnt, time_t delta)
+{
+	struct winsize ws;
+	unsigned int i, j, k, m, s, hs, w, lines = 3, runcnt = 0, waitcnt = 0;
+	char buff[8];
 
-			if (j > i + 1) {
-				memcpy(info + i + 1, info + j, (totcnt - j) * sizeof(threadinfo_t));
-				totcnt -= j - i - 1;
+	psh_top_load(info, previnfo, totcnt, delta, NULL);
+
+	/* Aggregate threads into processes in a single compacting pass */
+	if (!psh_top_common.threads) {
+		qsort(info, totcnt, sizeof(threadinfo_t), psh_top_cmppid);
+		for (i = 0, k = 0; i < totcnt; i = j, k++) {
+			if (k != i)
+				info[k] = info[i];
+			info[k].tid = 1;
+
+			for (j = i + 1; j < totcnt && info[j].pid == info[k].pid; j++) {
+				info[k].tid++;
+				info[k].load += info[j].load;
+				info[k].cpuTime += info[j].cpuTime;
+				info[k].priority = min(info[k].priority, info[j].priority);
+				info[k].state = min(info[k].state, info[j].state);
+				info[k].wait = max(info[k].wait, info[j].wait);
 			}
 		}
+		totcnt = k;
 	}
 	qsort(info, totcnt, sizeof(threadinfo_t), psh_top_common.cmp);
 
@@ -240,13 +294,17 @@ static void psh_top_refresh(char cmd, threadinfo_t *info, threadinfo_t *previnfo
 }
 
 
-static void psh_top_free(threadinfo_t *info, threadinfo_t *previnfo)
+static void psh_top_free(threadinfo_t *info, threadinfo_t *previnfo, int batch)
 {
 	free(info);
 	free(previnfo);
-	printf("\033[?25h");
-	psh_top_switchmode(1);
-	setvbuf(stdout, NULL, _IOLBF, 0);
+	free(psh_top_common.dcpu);
+	psh_top_common.dcpu = NULL;
+	if (!batch) {
+		printf("\033[?25h");
+		psh_top_switchmode(1);
+		setvbuf(stdout, NULL, _IOLBF, 0);
+	}
 }
 
 
@@ -258,23 +316,33 @@ void psh_topinfo(void)
 
 int psh_top(int argc, char **argv)
 {
-	int c, err = 0, cmd = 0, itermode = 1, run = 1, ret = EOK;
+	int c, err = 0, cmd = 0, itermode = 1, run = 1, ret = EOK, batch = 0, fmt = fmt_csv;
 	unsigned int totcnt, n = 32, delay = 3, niter = 0;
 	threadinfo_t *info, *rinfo, *previnfo;
-	time_t prev_time = 0;
+	time_t *rdcpu, prev_time = 0, start_time = 0;
 	struct timespec ts;
 	char *end;
 
 	psh_top_common.threads = 0;
 	psh_top_common.sortdir = -1;
 	psh_top_common.cmp = psh_top_cmpcpu;
+	psh_top_common.prevcnt = 0;
+	psh_top_common.dcpu = NULL;
 
-	while ((c = getopt(argc, argv, "Hd:n:h")) != -1) {
+	while ((c = getopt(argc, argv, "Hd:n:bjh")) != -1) {
 		switch (c) {
 		case 'H':
 			psh_top_common.threads = 1;
 			break;
 
+		case 'b':
+			batch = 1;
+			break;
+
+		case 'j':
+			fmt = fmt_json;
+			break;
+
 		case 'd':
 			delay = strtoul(optarg, &end, 10);
 			if (*end != '\0' || !delay) {
@@ -309,15 +377,27 @@ int psh_top(int argc, char **argv)
 		return -ENOMEM;
 	}
 
-	/* To refresh all tasks at once, flush stdout on fflush only */
-	setvbuf(stdout, NULL,_IOFBF, 0);
-	psh_top_switchmode(0);
+	if (batch) {
+		if ((psh_top_common.dcpu = malloc(n * sizeof(time_t))) == NULL) {
+			fprintf(stderr, "top: out of memory\n");
+			psh_top_free(info, previnfo, batch);
+			return -ENOMEM;
+		}
 
-	/* Clear terminal */
-	printf("\033[2J");
+		if (fmt == fmt_csv)
+			printf("time,pid,tid,ppid,priority,state,cputime,dcputime,load,vmem,name\n");
+	}
+	else {
+		/* To refresh all tasks at once, flush stdout on fflush only */
+		setvbuf(stdout, NULL,_IOFBF, 0);
+		psh_top_switchmode(0);
+
+		/* Clear terminal */
+		printf("\033[2J");
 
-	/* Disable cursor */
-	printf("\033[?25l");
+		/* Disable cursor */
+		printf("\033[?25l");
+	}
 
 	while (!psh_common.sigint && !psh_common.sigquit && !psh_common.sigstop && run) {
 		time_t delta, now;
@@ -328,23 +408,41 @@ int psh_top(int argc, char **argv)
 			n *= 2;
 			if ((rinfo = realloc(info, n * sizeof(threadinfo_t))) == NULL) {
 				fprintf(stderr, "ps: out of memory\n");
-				psh_top_free(info, previnfo);
+				psh_top_free(info, previnfo, batch);
 				return -ENOMEM;
 			}
 			info = rinfo;
 			if ((rinfo = realloc(previnfo, n * sizeof(threadinfo_t))) == NULL) {
 				fprintf(stderr, "ps: out of memory\n");
-				psh_top_free(info, previnfo);
+				psh_top_free(info, previnfo, batch);
 				return -ENOMEM;
 			}
 			previnfo = rinfo;
+			if (batch) {
+				if ((rdcpu = realloc(psh_top_common.dcpu, n * sizeof(time_t))) == NULL) {
+					fprintf(stderr, "ps: out of memory\n");
+					psh_top_free(info, previnfo, batch);
+					return -ENOMEM;
+				}
+				psh_top_common.dcpu = rdcpu;
+			}
 		}
 
 		now = ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 		delta = now - prev_time;
 		prev_time = now;
 
-		psh_top_refresh(err, info, previnfo, totcnt, delta);
+		if (batch) {
+			/* Samples are timestamped in ms since the first one */
+			if (start_time == 0)
+				start_time = now;
+
+			psh_top_load(info, previnfo, totcnt, delta, psh_top_common.dcpu);
+			psh_top_batch(fmt, info, totcnt, (now - start_time) / 1000);
+		}
+		else {
+			psh_top_refresh(err, info, previnfo, totcnt, delta);
+		}
 		fflush(stdout);
 		err = 0;
 
@@ -354,6 +452,11 @@ int psh_top(int argc, char **argv)
 				break;
 		}
 
+		if (batch) {
+			sleep(delay);
+			continue;
+		}
+
 		cmd = psh_top_waitcmd(delay);
 		switch (cmd) {
 			case '\n':
@@ -393,7 +496,7 @@ int psh_top(int argc, char **argv)
 				err = cmd;
 		}
 	}
-	psh_top_free(info, previnfo);
+	psh_top_free(info, previnfo, batch);
 
 	return ret;
 }